@@ -0,0 +1,263 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/drivers/adc/voltage_divider.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/logging/log.h>
+
+#include "battery.h"
+
+LOG_MODULE_REGISTER(helium_meteo_battery);
+
+BUILD_ASSERT(BATTERY_ENABLED,
+	     "CONFIG_ADC needs a vbatt voltage divider node or the STM32 VBAT channel, "
+	     "see README.md");
+
+/* A measurement at most this often, however often we send. */
+#define BATTERY_MEASURE_INTERVAL_SEC 3600
+/* Conversions averaged into a measurement */
+#define BATTERY_SAMPLES 8
+/* Time for the divider output to settle once powered */
+#define BATTERY_SETTLE_MS 1
+
+#if BATTERY_DIVIDER_ENABLED
+#define VBATT DT_PATH(vbatt)
+
+static const struct voltage_divider_dt_spec battery_divider = VOLTAGE_DIVIDER_DT_SPEC_GET(VBATT);
+static const struct gpio_dt_spec battery_power = GPIO_DT_SPEC_GET_OR(VBATT, power_gpios, {0});
+#else
+static const struct device *const battery_vbat = DEVICE_DT_GET_ONE(st_stm32_vbat);
+#endif
+
+/* Two alkaline AA cells at a light load. */
+const struct battery_level_point battery_levels[] = {
+	{ 10000, 3100 },
+	{ 9000, 2900 },
+	{ 7000, 2700 },
+	{ 4000, 2500 },
+	{ 1500, 2300 },
+	{ 0, 2000 },
+};
+
+static K_MUTEX_DEFINE(battery_lock);
+static int battery_setup_err;
+static int battery_mV;
+static int64_t battery_measured_ms;
+
+#if BATTERY_DIVIDER_ENABLED
+static int battery_setup(void)
+{
+	int err;
+
+	if (!adc_is_ready_dt(&battery_divider.port)) {
+		battery_setup_err = -ENODEV;
+		return 0;
+	}
+
+	if (battery_power.port != NULL) {
+		if (!gpio_is_ready_dt(&battery_power)) {
+			battery_setup_err = -ENODEV;
+			return 0;
+		}
+		/* The divider draws current, keep it off between measurements. */
+		err = gpio_pin_configure_dt(&battery_power, GPIO_OUTPUT_INACTIVE);
+		if (err) {
+			battery_setup_err = err;
+			return 0;
+		}
+	}
+
+	battery_setup_err = adc_channel_setup_dt(&battery_divider.port);
+	if (battery_setup_err) {
+		LOG_ERR("ADC channel setup failed: %d", battery_setup_err);
+	}
+
+	return 0;
+}
+SYS_INIT(battery_setup, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+/* Returns the voltage in mV, or a negative error code. */
+static int battery_sample(void)
+{
+	int16_t raw;
+	struct adc_sequence seq = {
+		.buffer = &raw,
+		.buffer_size = sizeof(raw),
+	};
+	int32_t val = 0;
+	int i, err;
+
+	if (battery_setup_err) {
+		return battery_setup_err;
+	}
+
+	err = adc_sequence_init_dt(&battery_divider.port, &seq);
+	if (err) {
+		return err;
+	}
+
+	if (battery_power.port != NULL) {
+		gpio_pin_set_dt(&battery_power, 1);
+		k_msleep(BATTERY_SETTLE_MS);
+	}
+
+	for (i = 0; i < BATTERY_SAMPLES; i++) {
+		err = adc_read_dt(&battery_divider.port, &seq);
+		if (err) {
+			break;
+		}
+		val += raw;
+	}
+
+	if (battery_power.port != NULL) {
+		gpio_pin_set_dt(&battery_power, 0);
+	}
+
+	if (err) {
+		return err;
+	}
+
+	val /= BATTERY_SAMPLES;
+	err = adc_raw_to_millivolts_dt(&battery_divider.port, &val);
+	if (err) {
+		return err;
+	}
+
+	/* Scale from the divider output up to the battery voltage. */
+	err = voltage_divider_scale_dt(&battery_divider, &val);
+	if (err) {
+		return err;
+	}
+
+	return val;
+}
+#else
+static int battery_setup(void)
+{
+	if (!device_is_ready(battery_vbat)) {
+		battery_setup_err = -ENODEV;
+	}
+
+	return 0;
+}
+SYS_INIT(battery_setup, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+/* Returns the voltage in mV, or a negative error code. */
+static int battery_sample(void)
+{
+	struct sensor_value val;
+	int32_t mV = 0;
+	int i, err;
+
+	if (battery_setup_err) {
+		return battery_setup_err;
+	}
+
+	/* The driver scales VBAT back up from the internal bridge. */
+	for (i = 0; i < BATTERY_SAMPLES; i++) {
+		err = sensor_sample_fetch(battery_vbat);
+		if (err == 0) {
+			err = sensor_channel_get(battery_vbat, SENSOR_CHAN_VOLTAGE, &val);
+		}
+		if (err) {
+			return err;
+		}
+		mV += val.val1 * 1000 + val.val2 / 1000;
+	}
+
+	return mV / BATTERY_SAMPLES;
+}
+#endif
+
+static int battery_measure_locked(void)
+{
+	int mV = battery_sample();
+
+	if (mV < 0) {
+		LOG_ERR("Battery measurement failed: %d", mV);
+		return mV;
+	}
+
+	battery_mV = mV;
+	battery_measured_ms = k_uptime_get();
+	LOG_DBG("Battery: %d mV", mV);
+
+	return mV;
+}
+
+int battery_measure(void)
+{
+	int mV;
+
+	k_mutex_lock(&battery_lock, K_FOREVER);
+	mV = battery_measure_locked();
+	k_mutex_unlock(&battery_lock);
+
+	return mV;
+}
+
+void battery_tx_done(void)
+{
+	k_mutex_lock(&battery_lock, K_FOREVER);
+	if (!battery_measured_ms ||
+	    k_uptime_get() - battery_measured_ms >= BATTERY_MEASURE_INTERVAL_SEC * MSEC_PER_SEC) {
+		battery_measure_locked();
+	}
+	k_mutex_unlock(&battery_lock);
+}
+
+int read_battery(int *batt_mV)
+{
+	int err = 0;
+
+	k_mutex_lock(&battery_lock, K_FOREVER);
+	if (!battery_measured_ms) {
+		/* Nothing sent yet since boot */
+		err = battery_measure_locked();
+	}
+	if (err >= 0) {
+		*batt_mV = battery_mV;
+		err = 0;
+	}
+	k_mutex_unlock(&battery_lock);
+
+	return err;
+}
+
+int64_t battery_measured_at(void)
+{
+	return battery_measured_ms;
+}
+
+unsigned int battery_level_pptt(unsigned int batt_mV,
+				const struct battery_level_point *curve)
+{
+	const struct battery_level_point *pb = curve;
+
+	if (batt_mV >= pb->lvl_mV) {
+		/* Full */
+		return pb->lvl_pptt;
+	}
+
+	/* Find the first point at or below batt_mV */
+	while (pb->lvl_pptt > 0 && batt_mV < pb->lvl_mV) {
+		pb++;
+	}
+	if (batt_mV < pb->lvl_mV) {
+		/* Below the last point: empty */
+		return pb->lvl_pptt;
+	}
+
+	/* Interpolate between the points around batt_mV */
+	const struct battery_level_point *pa = pb - 1;
+
+	return pb->lvl_pptt +
+		((pa->lvl_pptt - pb->lvl_pptt) * (batt_mV - pb->lvl_mV) /
+		 (pa->lvl_mV - pb->lvl_mV));
+}
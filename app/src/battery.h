@@ -0,0 +1,59 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_BATTERY_H__
+#define __HELIUM_METEO_BATTERY_H__
+
+#include <stdint.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Battery voltage monitor, after the Zephyr battery sample. The battery
+ * is read through the voltage divider of the "vbatt" devicetree node if
+ * there is one, which is only powered for the few conversions of a
+ * measurement. Otherwise it is read on the STM32 internal VBAT channel.
+ * Measurements are taken right after an uplink, when the battery is
+ * still loaded and its sag shows, and at most once an interval. Readers
+ * get the cached result, so they never cost an ADC conversion.
+ */
+#define BATTERY_DIVIDER_ENABLED \
+	(IS_ENABLED(CONFIG_ADC) && DT_NODE_HAS_STATUS_OKAY(DT_PATH(vbatt)))
+#define BATTERY_ENABLED (BATTERY_DIVIDER_ENABLED || IS_ENABLED(CONFIG_STM32_VBAT))
+
+/* A point of a discharge curve. */
+struct battery_level_point {
+	/* Remaining capacity, in parts per ten thousand */
+	uint16_t lvl_pptt;
+	/* Battery voltage at that capacity, in mV */
+	uint16_t lvl_mV;
+};
+
+/*
+ * Discharge curve of the battery, from full to empty, ending with a
+ * zero capacity point.
+ */
+extern const struct battery_level_point battery_levels[];
+
+/* Measure now, and cache the result. Returns the voltage in mV. */
+int battery_measure(void);
+
+/* An uplink just ended: measure, unless the cache is still recent. */
+void battery_tx_done(void);
+
+/*
+ * Get the cached battery voltage, in mV, and measure first if there is
+ * none yet. Returns 0 or a negative error code.
+ */
+int read_battery(int *batt_mV);
+
+/* Uptime of the cached measurement, in ms, or 0 if there is none. */
+int64_t battery_measured_at(void);
+
+/* Remaining capacity at batt_mV on the curve, in parts per ten thousand. */
+unsigned int battery_level_pptt(unsigned int batt_mV,
+				const struct battery_level_point *curve);
+
+#endif /* __HELIUM_METEO_BATTERY_H__ */
@@ -0,0 +1,156 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/posix/time.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+
+#include "clock_sync.h"
+
+LOG_MODULE_REGISTER(helium_meteo_clock_sync);
+
+/* Time requests once a day, and at most hourly while unanswered. */
+#define CLOCK_SYNC_INTERVAL_SEC 86400
+#define CLOCK_SYNC_RETRY_SEC 3600
+/* Answers have a 1 s resolution, so closer ones give no useful drift. */
+#define CLOCK_SYNC_DRIFT_MIN_SEC (12 * 3600)
+/* More than any crystal: the answer is wrong, not the clock. */
+#define CLOCK_SYNC_DRIFT_MAX_PPB 200000
+/* Each drift measurement weighs 1 / 2^shift */
+#define CLOCK_SYNC_DRIFT_EMA_SHIFT 2
+/* Plausible answers, from 2020 to 2100 */
+#define CLOCK_SYNC_GPS_MIN_S 1261872018U
+#define CLOCK_SYNC_GPS_MAX_S (CLOCK_SYNC_GPS_MIN_S + 80U * 365 * 86400)
+
+static struct k_spinlock sync_lock;
+static struct clock_sync sync;
+static bool sync_drift_measured;
+
+static int64_t sync_gps_ms(int64_t uptime_ms)
+{
+	int64_t elapsed_ms = uptime_ms - sync.uptime_ms;
+
+	return sync.gps_ms + elapsed_ms + elapsed_ms * sync.drift_ppb / 1000000000;
+}
+
+bool clock_sync_before_uplink(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&sync_lock);
+	int64_t now = k_uptime_get();
+	bool request = true;
+
+	if (sync.requested_ms && now - sync.requested_ms < CLOCK_SYNC_RETRY_SEC * MSEC_PER_SEC) {
+		request = false;
+	} else if (sync.synced &&
+		   now - sync.uptime_ms < (int64_t)CLOCK_SYNC_INTERVAL_SEC * MSEC_PER_SEC) {
+		request = false;
+	}
+	if (request) {
+		sync.requested_ms = now;
+	}
+
+	k_spin_unlock(&sync_lock, key);
+
+	return request;
+}
+
+/* The step of the answer tells how far off the drift was. */
+static void sync_measure_drift(int64_t step_ms, int64_t elapsed_ms)
+{
+	int64_t drift_ppb;
+
+	if (elapsed_ms < (int64_t)CLOCK_SYNC_DRIFT_MIN_SEC * MSEC_PER_SEC) {
+		return;
+	}
+
+	drift_ppb = sync.drift_ppb + step_ms * 1000000000 / elapsed_ms;
+	if (drift_ppb > CLOCK_SYNC_DRIFT_MAX_PPB || drift_ppb < -CLOCK_SYNC_DRIFT_MAX_PPB) {
+		return;
+	}
+
+	if (sync_drift_measured) {
+		sync.drift_ppb += (drift_ppb - sync.drift_ppb) / (1 << CLOCK_SYNC_DRIFT_EMA_SHIFT);
+	} else {
+		sync.drift_ppb = drift_ppb;
+		sync_drift_measured = true;
+	}
+}
+
+int clock_sync_answer(uint32_t gps_s)
+{
+	/* The answer has a 1 s resolution: take the middle of that second. */
+	int64_t gps_ms = (int64_t)gps_s * MSEC_PER_SEC + MSEC_PER_SEC / 2;
+	int64_t now = k_uptime_get();
+	struct timespec ts;
+	k_spinlock_key_t key;
+	int64_t step_ms = 0;
+	int32_t drift_ppb;
+
+	if (gps_s < CLOCK_SYNC_GPS_MIN_S || gps_s > CLOCK_SYNC_GPS_MAX_S) {
+		LOG_WRN("Implausible network time %u", gps_s);
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&sync_lock);
+
+	if (sync.synced) {
+		step_ms = gps_ms - sync_gps_ms(now);
+		sync_measure_drift(step_ms, now - sync.uptime_ms);
+		sync.last_step_ms = CLAMP(step_ms, INT32_MIN, INT32_MAX);
+	} else {
+		sync.synced = true;
+	}
+	sync.gps_ms = gps_ms;
+	sync.uptime_ms = now;
+	sync.answers++;
+	drift_ppb = sync.drift_ppb;
+
+	k_spin_unlock(&sync_lock, key);
+
+	LOG_INF("Network time %u, step %lld ms, drift %d ppb", gps_s, (long long)step_ms,
+		drift_ppb);
+
+	ts.tv_sec = (time_t)gps_s + CLOCK_SYNC_GPS_UNIX_OFFSET_S;
+	ts.tv_nsec = NSEC_PER_SEC / 2;
+	clock_settime(CLOCK_REALTIME, &ts);
+
+	return 0;
+}
+
+void clock_sync_rejoined(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&sync_lock);
+
+	sync.requested_ms = 0;
+
+	k_spin_unlock(&sync_lock, key);
+}
+
+int clock_sync_gps_now(uint32_t *gps_s)
+{
+	k_spinlock_key_t key = k_spin_lock(&sync_lock);
+	int err = -EAGAIN;
+
+	if (sync.synced) {
+		*gps_s = (uint32_t)(sync_gps_ms(k_uptime_get()) / MSEC_PER_SEC);
+		err = 0;
+	}
+
+	k_spin_unlock(&sync_lock, key);
+
+	return err;
+}
+
+void clock_sync_get(struct clock_sync *cs)
+{
+	k_spinlock_key_t key = k_spin_lock(&sync_lock);
+
+	*cs = sync;
+
+	k_spin_unlock(&sync_lock, key);
+}
@@ -0,0 +1,57 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_CLOCK_SYNC_H__
+#define __HELIUM_METEO_CLOCK_SYNC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Network time. A DeviceTimeReq is piggybacked on an uplink after
+ * joining, and then once a day, and its answer gives the GPS time.
+ * In between, the time is carried on by the uptime, which runs off the
+ * LSE crystal, corrected by the drift measured between the answers.
+ * Each answer also sets CLOCK_REALTIME.
+ */
+
+/* Seconds from the Unix to the GPS epoch, less the leap seconds since */
+#define CLOCK_SYNC_GPS_UNIX_OFFSET_S (315964800 - 18)
+
+struct clock_sync {
+	bool synced;
+	/* Corrected GPS time of the last answer, and the uptime of it, in ms */
+	int64_t gps_ms;
+	int64_t uptime_ms;
+	/* The network clock runs faster than the uptime by this much */
+	int32_t drift_ppb;
+	/* Correction made by the last answer, in ms */
+	int32_t last_step_ms;
+	uint32_t answers;
+	/* Uptime of the last request, in ms */
+	int64_t requested_ms;
+};
+
+/*
+ * Whether to request the time with the next uplink. Accounts the
+ * request if so.
+ */
+bool clock_sync_before_uplink(void);
+
+/*
+ * The network answered with gps_s, the current GPS time in seconds.
+ * Returns -EINVAL, ignoring the answer, if it cannot be right.
+ */
+int clock_sync_answer(uint32_t gps_s);
+
+/* Joined again: request the time soon. */
+void clock_sync_rejoined(void);
+
+/* Current GPS time in seconds. Returns -EAGAIN if not synced yet. */
+int clock_sync_gps_now(uint32_t *gps_s);
+
+void clock_sync_get(struct clock_sync *cs);
+
+#endif /* __HELIUM_METEO_CLOCK_SYNC_H__ */
@@ -0,0 +1,151 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+#include "lorawan_config.h"
+#include "downlink.h"
+#include "nvm.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(helium_meteo_downlink);
+
+struct downlink_setting_descr {
+	uint8_t type;
+	/* Setting name, as in nvm.c */
+	const char *name;
+	size_t size;
+	off_t offset;
+	uint32_t min;
+	uint32_t max;
+	uint32_t changed;
+};
+
+#define DOWNLINK_SETTING_DESCR(_type, _member, _min, _max, _changed)		\
+	{									\
+		.type = _type,							\
+		.name = STRINGIFY(_member),					\
+		.offset = offsetof(struct s_lorawan_config, _member),		\
+		.size = sizeof(((struct s_lorawan_config *)0)->_member),	\
+		.min = _min,							\
+		.max = _max,							\
+		.changed = _changed,						\
+	}
+
+/*
+ * A bad downlink must not silence the device for good, as no further
+ * downlink could then reach it. Hence the minimum intervals.
+ */
+static const struct downlink_setting_descr downlink_setting_descriptors[] = {
+	DOWNLINK_SETTING_DESCR(DOWNLINK_SEND_INTERVAL, send_repeat_time,
+			       60, 7 * 24 * 3600,
+			       DOWNLINK_CHANGED_SEND_TIMER | DOWNLINK_CHANGED_SAMPLE_TIMER),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_SAMPLE_INTERVAL, sample_interval,
+			       0, 24 * 3600, DOWNLINK_CHANGED_SAMPLE_TIMER),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_ADAPTIVE_SEND, adaptive_send,
+			       0, 1, DOWNLINK_CHANGED_SEND_TIMER | DOWNLINK_CHANGED_SAMPLE_TIMER),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_TEMP_THRESHOLD, temp_threshold,
+			       0, 100000, 0),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_PRESS_THRESHOLD, press_threshold,
+			       0, 100000, 0),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_HUMIDITY_THRESHOLD, humidity_threshold,
+			       0, 100, 0),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_MAX_SILENCE_TIME, max_silence_time,
+			       60, 7 * 24 * 3600, DOWNLINK_CHANGED_SEND_TIMER),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_DATA_RATE, data_rate,
+			       LORAWAN_DR_0, LORAWAN_DR_7, DOWNLINK_CHANGED_DATA_RATE),
+	DOWNLINK_SETTING_DESCR(DOWNLINK_CONFIRMED_MSG, confirmed_msg,
+			       LORAWAN_MSG_UNCONFIRMED, LORAWAN_MSG_CONFIRMED, 0),
+};
+
+static const struct downlink_setting_descr *downlink_setting_find(uint8_t type)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(downlink_setting_descriptors); i++) {
+		if (downlink_setting_descriptors[i].type == type) {
+			return &downlink_setting_descriptors[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Walk the TLVs, and apply them if apply is set. Returns the changed
+ * flags, or a negative error code.
+ */
+static int downlink_config_walk(const uint8_t *data, size_t len, bool apply)
+{
+	const struct downlink_setting_descr *descr;
+	uint8_t *cfg = (uint8_t *)&lorawan_config;
+	uint32_t changed = 0;
+	size_t pos = 0;
+
+	while (pos < len) {
+		uint8_t type, val_len;
+		uint32_t val = 0;
+
+		if (len - pos < 2) {
+			return -EINVAL;
+		}
+		type = data[pos++];
+		val_len = data[pos++];
+		if (val_len < 1 || val_len > sizeof(val) || val_len > len - pos) {
+			return -EINVAL;
+		}
+		for (int i = 0; i < val_len; i++) {
+			val |= (uint32_t)data[pos++] << (8 * i);
+		}
+
+		descr = downlink_setting_find(type);
+		if (descr == NULL) {
+			LOG_WRN("Unknown setting %#x", type);
+			return -ENOENT;
+		}
+		if (val < descr->min || val > descr->max) {
+			LOG_WRN("%s: %u out of range", descr->name, val);
+			return -ERANGE;
+		}
+
+		if (!apply) {
+			continue;
+		}
+
+		switch (descr->size) {
+		case sizeof(uint8_t):
+			cfg[descr->offset] = (uint8_t)val;
+			break;
+		case sizeof(uint16_t):
+			UNALIGNED_PUT((uint16_t)val, (uint16_t *)&cfg[descr->offset]);
+			break;
+		default:
+			UNALIGNED_PUT(val, (uint32_t *)&cfg[descr->offset]);
+			break;
+		}
+		changed |= descr->changed;
+
+		LOG_INF("Remote config: %s = %u", descr->name, val);
+#if IS_ENABLED(CONFIG_SETTINGS)
+		hm_lorawan_nvm_save_settings(descr->name);
+#endif
+	}
+
+	return changed;
+}
+
+int downlink_config_apply(const uint8_t *data, size_t len)
+{
+	int err;
+
+	err = downlink_config_walk(data, len, false);
+	if (err < 0) {
+		return err;
+	}
+
+	return downlink_config_walk(data, len, true);
+}
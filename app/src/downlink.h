@@ -0,0 +1,51 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_DOWNLINK_H__
+#define __HELIUM_METEO_DOWNLINK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Remote configuration. Downlinks on DOWNLINK_CONFIG_PORT carry
+ * settings as back-to-back TLVs:
+ *
+ *   [type][len][value, len bytes little endian]...
+ *
+ * Values are unsigned, 1 to 4 bytes long, so small ones take a single
+ * byte. Either all settings of a downlink are applied, or none if any
+ * of them is unknown or out of range. Applied settings are saved.
+ */
+#define DOWNLINK_CONFIG_PORT 4
+/* Largest downlink at EU868 DR0 */
+#define DOWNLINK_CONFIG_MAX_SIZE 51
+
+enum downlink_config_type {
+	DOWNLINK_SEND_INTERVAL = 0x01,		/* s */
+	DOWNLINK_SAMPLE_INTERVAL = 0x02,	/* s, 0 to sample on send */
+	DOWNLINK_ADAPTIVE_SEND = 0x03,		/* 0/1 */
+	DOWNLINK_TEMP_THRESHOLD = 0x04,		/* mK */
+	DOWNLINK_PRESS_THRESHOLD = 0x05,	/* Pa */
+	DOWNLINK_HUMIDITY_THRESHOLD = 0x06,	/* %RH */
+	DOWNLINK_MAX_SILENCE_TIME = 0x07,	/* s */
+	DOWNLINK_DATA_RATE = 0x08,		/* enum lorawan_datarate */
+	DOWNLINK_CONFIRMED_MSG = 0x09,		/* 0/1 */
+};
+
+/* What the applied settings need updated */
+#define DOWNLINK_CHANGED_SEND_TIMER BIT(0)
+#define DOWNLINK_CHANGED_SAMPLE_TIMER BIT(1)
+#define DOWNLINK_CHANGED_DATA_RATE BIT(2)
+
+/*
+ * Apply a configuration downlink to lorawan_config. Returns a mask of
+ * DOWNLINK_CHANGED_* flags, or a negative error code if nothing was
+ * applied.
+ */
+int downlink_config_apply(const uint8_t *data, size_t len);
+
+#endif /* __HELIUM_METEO_DOWNLINK_H__ */
@@ -0,0 +1,112 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+#include "lorawan_config.h"
+#include "energy.h"
+#include "payload.h"
+
+static struct k_spinlock energy_lock;
+
+/*
+ * Use the uptime tick counter rather than the cycle counter: it keeps
+ * running in low-power modes, and does not wrap within a few seconds.
+ */
+int64_t energy_phase_begin(void)
+{
+	return k_uptime_ticks();
+}
+
+static void energy_account(enum energy_phase phase, uint64_t ms)
+{
+	lorawan_status.energy.time_ms[phase] += ms;
+	lorawan_status.energy.charge_uC[phase] +=
+		ms * lorawan_config.energy_current_uA[phase] / MSEC_PER_SEC;
+}
+
+void energy_phase_end(enum energy_phase phase, int64_t begin)
+{
+	k_spinlock_key_t key = k_spin_lock(&energy_lock);
+
+	energy_account(phase, k_ticks_to_ms_floor64(k_uptime_ticks() - begin));
+
+	k_spin_unlock(&energy_lock, key);
+}
+
+void energy_update(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&energy_lock);
+	uint64_t uptime_ms = k_uptime_get();
+	uint64_t accounted_ms = 0;
+
+	for (int i = 0; i < ENERGY_PHASE_COUNT; i++) {
+		accounted_ms += lorawan_status.energy.time_ms[i];
+	}
+	if (uptime_ms > accounted_ms) {
+		energy_account(ENERGY_PHASE_SLEEP, uptime_ms - accounted_ms);
+	}
+
+	k_spin_unlock(&energy_lock, key);
+}
+
+const char *energy_phase_str(enum energy_phase phase)
+{
+	switch (phase) {
+	case ENERGY_PHASE_JOIN:
+		return "join";
+	case ENERGY_PHASE_SENSOR:
+		return "sensor";
+	case ENERGY_PHASE_RADIO:
+		return "radio";
+	case ENERGY_PHASE_SLEEP:
+		return "sleep";
+	default:
+		return "unknown";
+	}
+}
+
+uint32_t energy_average_uA(void)
+{
+	uint64_t time_ms = 0, charge_uC = 0;
+
+	energy_update();
+
+	for (int i = 0; i < ENERGY_PHASE_COUNT; i++) {
+		time_ms += lorawan_status.energy.time_ms[i];
+		charge_uC += lorawan_status.energy.charge_uC[i];
+	}
+
+	if (time_ms == 0) {
+		return 0;
+	}
+
+	return (uint32_t)(charge_uC * MSEC_PER_SEC / time_ms);
+}
+
+size_t energy_report_encode(uint8_t *buf, size_t size)
+{
+	size_t n = 0;
+
+	if (size < ENERGY_REPORT_MAX_SIZE) {
+		return 0;
+	}
+
+	energy_update();
+
+	buf[n++] = ENERGY_REPORT_FMT_V1;
+	for (int i = 0; i < ENERGY_PHASE_COUNT; i++) {
+		n += payload_put_uvarint(&buf[n],
+				lorawan_status.energy.time_ms[i] / MSEC_PER_SEC);
+	}
+	for (int i = 0; i < ENERGY_PHASE_COUNT; i++) {
+		/* uC to uAh */
+		n += payload_put_uvarint(&buf[n],
+				lorawan_status.energy.charge_uC[i] / 3600);
+	}
+
+	return n;
+}
@@ -0,0 +1,57 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_ENERGY_H__
+#define __HELIUM_METEO_ENERGY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Energy accounting. Each phase is timed, and its duration multiplied
+ * by the configured current draw of that phase gives an estimate of
+ * the charge it took. Time outside of all other phases is accounted
+ * as sleep.
+ */
+enum energy_phase {
+	ENERGY_PHASE_JOIN,
+	ENERGY_PHASE_SENSOR,
+	/* TX and the RX windows which follow it */
+	ENERGY_PHASE_RADIO,
+	ENERGY_PHASE_SLEEP,
+	ENERGY_PHASE_COUNT,
+};
+
+struct s_energy {
+	/* Time spent in each phase, in ms */
+	uint64_t time_ms[ENERGY_PHASE_COUNT];
+	/* Estimated charge drawn in each phase, in uC (uA * s) */
+	uint64_t charge_uC[ENERGY_PHASE_COUNT];
+};
+
+/* Diagnostic uplink format id, sent on LORA_DIAG_PORT. */
+#define ENERGY_REPORT_FMT_V1 0x01
+#define ENERGY_REPORT_MAX_SIZE (1 + 2 * ENERGY_PHASE_COUNT * 5)
+
+/* Returns a timestamp to pass to energy_phase_end(). */
+int64_t energy_phase_begin(void);
+void energy_phase_end(enum energy_phase phase, int64_t begin);
+
+/* Account the time not spent in other phases as sleep. */
+void energy_update(void);
+
+const char *energy_phase_str(enum energy_phase phase);
+
+/* Average current since boot, in uA. */
+uint32_t energy_average_uA(void);
+
+/*
+ * Encode the totals as:
+ *   [format id][time_s varint x phases][charge_uAh varint x phases]
+ * Returns the number of bytes written.
+ */
+size_t energy_report_encode(uint8_t *buf, size_t size);
+
+#endif /* __HELIUM_METEO_ENERGY_H__ */
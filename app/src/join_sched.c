@@ -0,0 +1,89 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/random/random.h>
+#include <zephyr/sys/util.h>
+
+#include "join_sched.h"
+
+/* Delay after the first failed attempt, doubled after each one. */
+#define JOIN_BACKOFF_MIN_SEC 15
+#define JOIN_BACKOFF_MAX_SEC (3 * 3600)
+
+/* Spread of the first attempt of a join session. */
+#define JOIN_START_JITTER_SEC 60
+
+/* Join request duty cycle, see the LoRaWAN 1.0.x "Retransmissions back-off". */
+#define JOIN_DUTY_CYCLE_FIRST_PHASE_SEC 3600
+#define JOIN_DUTY_CYCLE_SECOND_PHASE_SEC (11 * 3600)
+#define JOIN_DUTY_CYCLE_FIRST_SEC_PER_AIRTIME_SEC (3600 / 36)
+#define JOIN_DUTY_CYCLE_SECOND_SEC_PER_AIRTIME_SEC (10 * 3600 / 36)
+#define JOIN_DUTY_CYCLE_LATE_SEC_PER_AIRTIME_SEC (86400 * 10 / 87)
+
+/*
+ * EU868 time on air of the 23 byte join request, in ms, with an 8
+ * symbol preamble and explicit header. DR6 and up are faster than DR5.
+ */
+static const uint16_t join_airtime_ms[] = {
+	[LORAWAN_DR_0] = 1483,
+	[LORAWAN_DR_1] = 823,
+	[LORAWAN_DR_2] = 371,
+	[LORAWAN_DR_3] = 206,
+	[LORAWAN_DR_4] = 113,
+	[LORAWAN_DR_5] = 62,
+};
+
+void join_sched_reset(struct join_sched *js)
+{
+	/* The duty cycle phases count from the first attempt after boot. */
+	js->attempts = 0;
+}
+
+uint32_t join_sched_start_delay(void)
+{
+	return sys_rand32_get() % (JOIN_START_JITTER_SEC + 1);
+}
+
+uint32_t join_sched_airtime_ms(enum lorawan_datarate dr)
+{
+	return join_airtime_ms[MIN(dr, ARRAY_SIZE(join_airtime_ms) - 1)];
+}
+
+/* Shortest spacing of join requests which keeps within the duty cycle. */
+static uint32_t join_duty_cycle_sec(struct join_sched *js, enum lorawan_datarate dr)
+{
+	uint32_t airtime_ms = join_sched_airtime_ms(dr);
+	int64_t since_first_ms = k_uptime_get() - js->first_attempt_ms;
+	uint32_t sec_per_airtime_sec;
+
+	if (since_first_ms < (int64_t)JOIN_DUTY_CYCLE_FIRST_PHASE_SEC * MSEC_PER_SEC) {
+		sec_per_airtime_sec = JOIN_DUTY_CYCLE_FIRST_SEC_PER_AIRTIME_SEC;
+	} else if (since_first_ms < (int64_t)JOIN_DUTY_CYCLE_SECOND_PHASE_SEC * MSEC_PER_SEC) {
+		sec_per_airtime_sec = JOIN_DUTY_CYCLE_SECOND_SEC_PER_AIRTIME_SEC;
+	} else {
+		sec_per_airtime_sec = JOIN_DUTY_CYCLE_LATE_SEC_PER_AIRTIME_SEC;
+	}
+
+	return DIV_ROUND_UP(airtime_ms * sec_per_airtime_sec, MSEC_PER_SEC);
+}
+
+uint32_t join_sched_failed(struct join_sched *js, enum lorawan_datarate dr)
+{
+	uint32_t delay;
+
+	if (!js->first_attempt_ms) {
+		js->first_attempt_ms = k_uptime_get();
+	}
+
+	/* Past 2^10, the backoff is capped anyway. */
+	delay = JOIN_BACKOFF_MIN_SEC << MIN(js->attempts, 10);
+	delay = MIN(delay, JOIN_BACKOFF_MAX_SEC);
+	delay = MAX(delay, join_duty_cycle_sec(js, dr));
+	js->attempts++;
+
+	/* Up to half again as long, so that retries drift apart. */
+	return delay + sys_rand32_get() % (delay / 2 + 1);
+}
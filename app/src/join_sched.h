@@ -0,0 +1,42 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_JOIN_SCHED_H__
+#define __HELIUM_METEO_JOIN_SCHED_H__
+
+#include <stdint.h>
+#include <zephyr/lorawan/lorawan.h>
+
+/*
+ * Join scheduler. Failed join attempts are retried after a randomized,
+ * exponentially growing delay, so that devices which lost power
+ * together do not keep joining in lockstep. The delay never gets
+ * shorter than the join request duty cycle of the LoRaWAN spec allows:
+ * 36 s of airtime in the first hour after the first attempt, 36 s per
+ * 10 hours up to the 11th hour, and 8.7 s per day after that.
+ */
+struct join_sched {
+	/* Failed attempts since the last join */
+	uint32_t attempts;
+	/* Uptime of the first attempt since boot, in ms */
+	int64_t first_attempt_ms;
+};
+
+/* Start over, after a successful join. */
+void join_sched_reset(struct join_sched *js);
+
+/* Random delay before the first attempt of a join session, in seconds. */
+uint32_t join_sched_start_delay(void);
+
+/*
+ * Account a failed attempt at the given data rate. Returns the delay
+ * before the next attempt, in seconds.
+ */
+uint32_t join_sched_failed(struct join_sched *js, enum lorawan_datarate dr);
+
+/* Time on air of a join request, in ms. */
+uint32_t join_sched_airtime_ms(enum lorawan_datarate dr);
+
+#endif /* __HELIUM_METEO_JOIN_SCHED_H__ */
@@ -0,0 +1,154 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/util.h>
+
+#include "link_quality.h"
+
+/* Below this demodulation margin, the link is in doubt. */
+#define LINK_MARGIN_LOW_DB 3
+/* Link checks for a low margin or data rate are at most this often. */
+#define LINK_CHECK_MIN_INTERVAL_SEC 3600
+/* Unanswered uplinks in the inactive window before joining again. */
+#define LINK_REJOIN_MIN_UPLINKS 3
+
+/* EU868 demodulation floor of each data rate, in 0.1 dB SNR. */
+static const int16_t link_demod_floor_ddB[] = {
+	[LORAWAN_DR_0] = -200,
+	[LORAWAN_DR_1] = -175,
+	[LORAWAN_DR_2] = -150,
+	[LORAWAN_DR_3] = -125,
+	[LORAWAN_DR_4] = -100,
+	[LORAWAN_DR_5] = -75,
+};
+
+static struct k_spinlock link_lock;
+static struct link_quality link;
+
+static void link_heard(void)
+{
+	link.last_heard_ms = k_uptime_get();
+	link.uplinks_unheard = 0;
+	link.dr_dropped = false;
+	link.check_unanswered = false;
+}
+
+void link_quality_reset(enum lorawan_datarate dr)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+	/* The join accept, or a resumed session, counts as heard. */
+	link_heard();
+	link.dr = dr;
+	link.margin_db = INT8_MAX;
+	link.check_pending = false;
+	link.last_check_ms = k_uptime_get() - LINK_CHECK_MIN_INTERVAL_SEC * MSEC_PER_SEC;
+
+	k_spin_unlock(&link_lock, key);
+}
+
+void link_quality_downlink(int16_t rssi, int8_t snr)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+	int16_t floor_ddB = link_demod_floor_ddB[MIN(link.dr, LORAWAN_DR_5)];
+
+	link_heard();
+	link.rssi = rssi;
+	link.snr = snr;
+	/* A strong downlink at a slow data rate has a margin past int8_t. */
+	link.margin_db = CLAMP((snr * 10 - floor_ddB) / 10, INT8_MIN, INT8_MAX);
+
+	k_spin_unlock(&link_lock, key);
+}
+
+void link_quality_check_ans(uint8_t margin_db, uint8_t gateways)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+	link_heard();
+	link.margin_db = MIN(margin_db, INT8_MAX);
+	link.gateways = gateways;
+	link.check_pending = false;
+
+	k_spin_unlock(&link_lock, key);
+}
+
+void link_quality_datarate(enum lorawan_datarate dr)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+	if (dr < link.dr) {
+		link.dr_dropped = true;
+	}
+	link.dr = dr;
+
+	k_spin_unlock(&link_lock, key);
+}
+
+enum link_action link_quality_before_uplink(uint32_t inactive_window_sec, bool can_rejoin)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+	int64_t now = k_uptime_get();
+	int64_t unheard_ms = now - link.last_heard_ms;
+	int64_t window_ms = (int64_t)inactive_window_sec * MSEC_PER_SEC;
+	enum link_action action = LINK_ACTION_NONE;
+	bool silent, doubt;
+
+	silent = window_ms && unheard_ms >= window_ms &&
+		 link.uplinks_unheard >= LINK_REJOIN_MIN_UPLINKS;
+	if (silent && can_rejoin) {
+		k_spin_unlock(&link_lock, key);
+		return LINK_ACTION_REJOIN;
+	}
+
+	doubt = link.dr_dropped || link.margin_db < LINK_MARGIN_LOW_DB ||
+		(window_ms && unheard_ms >= window_ms / 2);
+
+	/* Without joining again, keep asking for an acknowledgement. */
+	if (link.check_unanswered || silent) {
+		action = LINK_ACTION_CONFIRM;
+		link.confirmed++;
+	} else if (doubt &&
+		   now - link.last_check_ms >= LINK_CHECK_MIN_INTERVAL_SEC * MSEC_PER_SEC) {
+		action = LINK_ACTION_CHECK;
+		link.check_pending = true;
+		link.last_check_ms = now;
+		link.checks++;
+	}
+	link.uplinks_unheard++;
+
+	k_spin_unlock(&link_lock, key);
+
+	return action;
+}
+
+void link_quality_after_uplink(bool confirmed, int err)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+	/* The answer comes in the receive windows of the uplink. */
+	if (link.check_pending) {
+		link.check_pending = false;
+		link.check_unanswered = true;
+	}
+
+	if (confirmed && err == 0) {
+		/* Acknowledged */
+		link_heard();
+	}
+
+	k_spin_unlock(&link_lock, key);
+}
+
+void link_quality_get(struct link_quality *lq)
+{
+	k_spinlock_key_t key = k_spin_lock(&link_lock);
+
+	*lq = link;
+
+	k_spin_unlock(&link_lock, key);
+}
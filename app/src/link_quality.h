@@ -0,0 +1,76 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_LINK_QUALITY_H__
+#define __HELIUM_METEO_LINK_QUALITY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/lorawan/lorawan.h>
+
+/*
+ * Link quality tracking. Any downlink, acknowledgement or link check
+ * answer proves that the network still hears the device. While that
+ * proof is recent and the margin is good, uplinks go out unconfirmed.
+ * When the link is in doubt, a LinkCheckReq is piggybacked on the next
+ * uplink, which costs a single downlink. Only if that goes unanswered
+ * are uplinks sent confirmed, and if the network stays silent for the
+ * whole inactive window, the device joins again.
+ */
+enum link_action {
+	/* Send as configured */
+	LINK_ACTION_NONE,
+	/* Request a link check with this uplink */
+	LINK_ACTION_CHECK,
+	/* Send this uplink confirmed */
+	LINK_ACTION_CONFIRM,
+	/* Do not send, join again */
+	LINK_ACTION_REJOIN,
+};
+
+struct link_quality {
+	/* Uptime of the last proof that the network hears us, in ms */
+	int64_t last_heard_ms;
+	/* Uplinks sent since then */
+	uint32_t uplinks_unheard;
+	/* Last downlink */
+	int16_t rssi;
+	int8_t snr;
+	/* Demodulation margin in dB of the last link check answer or downlink */
+	int8_t margin_db;
+	/* Gateways which received the last link check */
+	uint8_t gateways;
+	enum lorawan_datarate dr;
+	/* ADR lowered the data rate since the network was last heard */
+	bool dr_dropped;
+	bool check_pending;
+	bool check_unanswered;
+	int64_t last_check_ms;
+	uint32_t checks;
+	uint32_t confirmed;
+};
+
+/* Start over with a fresh session, sent at the given data rate. */
+void link_quality_reset(enum lorawan_datarate dr);
+
+/* Called from the LoRaWAN stack callbacks. */
+void link_quality_downlink(int16_t rssi, int8_t snr);
+void link_quality_check_ans(uint8_t margin_db, uint8_t gateways);
+void link_quality_datarate(enum lorawan_datarate dr);
+
+/*
+ * Decide how to send the next uplink. inactive_window_sec is the time
+ * without hearing from the network before joining again, 0 to never
+ * join again for that. If the caller cannot join again, e.g. with
+ * auto join off, a silent network gets confirmed uplinks instead.
+ */
+enum link_action link_quality_before_uplink(uint32_t inactive_window_sec, bool can_rejoin);
+
+/* Account the uplink decided on by link_quality_before_uplink(). */
+void link_quality_after_uplink(bool confirmed, int err);
+
+void link_quality_get(struct link_quality *lq);
+
+#endif /* __HELIUM_METEO_LINK_QUALITY_H__ */
@@ -7,6 +7,9 @@
 
 #include <stdio.h>
 #include <zephyr/lorawan/lorawan.h>
+#include <zephyr/sys/atomic.h>
+
+#include "energy.h"
 
 struct s_lorawan_config
 {
@@ -30,25 +33,44 @@ struct s_lorawan_config
 	bool auto_join;
 	/* Send repeat time in seconds */
 	uint32_t send_repeat_time;
-	/* Max attempt to join network */
-	uint8_t join_try_count;
-	/* Max LoraWAN join sessions retry count before reboot */
-	uint16_t max_join_retry_sessions_count;
-	/* Max LoraWAN join window interval in seconds */
-	uint32_t join_try_interval;
+	/* Sensor sample interval in seconds, 0 to sample only before sending */
+	uint32_t sample_interval;
+	/* Send only on significant change, or after max_silence_time */
+	bool adaptive_send;
+	/* Adaptive send thresholds, 0 to ignore the value */
+	uint32_t temp_threshold;	/* mK */
+	uint32_t press_threshold;	/* Pa */
+	uint8_t humidity_threshold;	/* %RH */
+	/* Max time between uplinks in adaptive mode, in seconds */
+	uint32_t max_silence_time;
 	/* Max time window of no ack'd msg received before re-join in seconds */
 	uint32_t max_inactive_time_window;
 	/* Number of failed message before re-join */
 	uint32_t max_failed_msg;
+	/* Estimated current draw of each energy phase in uA */
+	uint32_t energy_current_uA[ENERGY_PHASE_COUNT];
+	/* Battery capacity for the battery life projection */
+	uint32_t battery_capacity_mAh;
+	/* Send an energy report every that many uplinks, 0 to disable */
+	uint16_t energy_report_interval;
+	/* Encrypt data uplinks with payload_key, see payload_crypt.h */
+	bool payload_encrypt;
+	/* AES-128 key of the payload encryption */
+	uint8_t payload_key[16];
+	/* Sensor reads and filtering, enum meteo_profile_id */
+	uint8_t sensor_profile;
+	/* Joined session saved by the LoRaMAC NVM, resumed after reboot */
+	bool session_saved;
 };
 
 extern struct s_lorawan_config lorawan_config;
 
+/* Units are defined in meteo_units.h */
 struct s_meteo_data
 {
-	uint32_t temp_mK;
+	int16_t temp_cCel;
 	uint32_t pressure_Pa;
-	uint8_t humidity_percent;
+	uint16_t humidity_cRH;
 	uint16_t battery_mV;
 } __packed;
 
@@ -58,7 +80,17 @@ struct s_status {
 	uint32_t msgs_sent;
 	uint32_t msgs_failed;
 	uint32_t msgs_failed_total;
-	uint16_t join_retry_sessions_count;
+	/* Join attempts since boot */
+	uint32_t join_attempts;
+	/* Uptime of the next join attempt in ms, 0 if none is due */
+	int64_t join_next_ms;
+	/* Samples overwritten in RAM before they could be sent */
+	uint32_t samples_dropped;
+	/* Events posted while the same one was pending */
+	atomic_t events_coalesced;
+	/* Events lost, e.g. config downlinks while the queue was full */
+	atomic_t events_dropped;
+	struct s_energy energy;
 };
 
 extern struct s_status lorawan_status;
@@ -17,10 +17,25 @@
 
 
 #include "lorawan_config.h"
-#if IS_ENABLED(CONFIG_ADC)
+#include "clock_sync.h"
+#include "downlink.h"
+#include "energy.h"
+#include "join_sched.h"
+#include "link_quality.h"
+#include "meteo_profile.h"
+#include "meteo_sensor.h"
+#include "meteo_units.h"
 #include "battery.h"
-#endif
 #include "nvm.h"
+#include "payload.h"
+#include "power_governor.h"
+#if IS_ENABLED(CONFIG_TINYCRYPT_AES_CBC)
+#include "payload_crypt.h"
+#endif
+#include "samples.h"
+#if IS_ENABLED(CONFIG_FCB)
+#include "sample_log.h"
+#endif
 #if IS_ENABLED(CONFIG_SHELL)
 #include "shell.h"
 #endif
@@ -51,14 +66,28 @@ struct s_lorawan_config lorawan_config = {
 	.app_port = 2,
 	.auto_join = false,
 	.send_repeat_time = 3600 / 2,
-	/* max join attempt in one join session */
-	.join_try_count = 5,
-	/* max join sessions before give up and reboot. 20 * 5 = 100 join attempts */
-	.max_join_retry_sessions_count = 20,
-	/* max join session interval in sec */
-	.join_try_interval = 300,
+	.sample_interval = 0,
+	.adaptive_send = false,
+	/* 0.2 Cel */
+	.temp_threshold = 200,
+	/* 0.5 hPa */
+	.press_threshold = 50,
+	.humidity_threshold = 2,
+	.max_silence_time = 3 * 3600,
 	.max_inactive_time_window = 2 * 3600,
 	.max_failed_msg = 120,
+	/* Rough figures for STM32WL with BME280, measure your own board. */
+	.energy_current_uA = {
+		[ENERGY_PHASE_JOIN] = 10000,
+		[ENERGY_PHASE_SENSOR] = 1000,
+		[ENERGY_PHASE_RADIO] = 10000,
+		[ENERGY_PHASE_SLEEP] = 5,
+	},
+	/* 2x AA alkaline */
+	.battery_capacity_mAh = 2500,
+	.energy_report_interval = 0,
+	.payload_encrypt = false,
+	.sensor_profile = METEO_PROFILE_STANDARD,
 };
 
 struct s_status lorawan_status = {
@@ -66,11 +95,21 @@ struct s_status lorawan_status = {
 	.msgs_sent = 0,
 	.msgs_failed = 0,
 	.msgs_failed_total = 0,
-	.join_retry_sessions_count = 0,
+	.join_attempts = 0,
+	.samples_dropped = 0,
 };
 
-struct s_meteo_data meteo_data;
-char *data_ptr = (char*)&meteo_data;
+/* Largest application payload of any LoRaWAN region and data rate. */
+#define LORA_MSG_MAX_SIZE 242
+
+/* Spacing of uplinks which replay samples from the flash log. */
+#define LORA_BACKFILL_INTERVAL_SEC 60
+
+/* Port for diagnostic uplinks, e.g. energy reports. */
+#define LORA_DIAG_PORT 3
+
+/* Link margin needed to raise the data rate a step to save power. */
+#define LORA_POWER_DR_STEP_MARGIN_DB 10
 
 #define LORA_JOIN_THREAD_STACK_SIZE 1500
 #define LORA_JOIN_THREAD_PRIORITY 10
@@ -80,9 +119,16 @@ struct s_helium_meteo_ctx {
 	const struct device *lora_dev;
 	const struct device *meteo_dev;
 	struct k_timer send_timer;
-	struct k_timer lora_join_timer;
+	struct k_timer sample_timer;
+	struct k_timer backfill_timer;
 	struct k_thread thread;
 	struct k_sem lora_join_sem;
+	struct join_sched join_sched;
+	/* Data rate last set, see lora_datarate() */
+	enum lorawan_datarate datarate;
+	/* Newest sample sent, reference for adaptive send */
+	struct s_meteo_data adaptive_ref;
+	bool adaptive_ref_valid;
 };
 
 struct s_helium_meteo_ctx g_ctx;
@@ -92,58 +138,127 @@ enum lorawan_state_e {
 	JOINED,
 };
 
-/* Event queue. */
-
+/*
+ * Events, one bit each, handled by the main loop in the order below.
+ * Posting an event which is still pending coalesces with it, so bursts
+ * never overflow anything, and posting is safe from ISRs.
+ */
 enum evt_t {
+	/* Apply new settings before sending with the old ones */
+	EV_CONFIG_DOWNLINK,
+	EV_SAMPLE,
 	EV_TIMER,
 	EV_BUTTON,
 	EV_SEND_DATA,
+	EV_BACKFILL,
+	EV_ENERGY_REPORT,
+	EV_COUNT,
 };
 
-struct app_evt_t {
-	enum evt_t event_type;
+#define APP_EVT_ALL (BIT(EV_COUNT) - 1)
+
+K_EVENT_DEFINE(app_events);
+
+/* Configuration downlinks, applied from the event loop. */
+struct config_downlink {
+	uint8_t len;
+	uint8_t data[DOWNLINK_CONFIG_MAX_SIZE];
 };
 
-K_MSGQ_DEFINE(event_msgq, sizeof(struct app_evt_t), 10, 1);
+K_MSGQ_DEFINE(config_downlink_msgq, sizeof(struct config_downlink), 2, 1);
+
+static void app_evt_post(enum evt_t event_type)
+{
+	if (k_event_post(&app_events, BIT(event_type)) & BIT(event_type)) {
+		atomic_inc(&lorawan_status.events_coalesced);
+	}
+}
+
+/* Wait for the most urgent pending event, and take it. */
+static enum evt_t app_evt_get(void)
+{
+	uint32_t events = k_event_wait(&app_events, APP_EVT_ALL, false, K_FOREVER);
+	enum evt_t event_type = find_lsb_set(events) - 1;
+
+	k_event_clear(&app_events, BIT(event_type));
+
+	return event_type;
+}
+
+/*
+ * In adaptive mode the send timer only enforces the max silence time.
+ * On a low battery, the power profile stretches the intervals.
+ */
+static uint32_t send_interval(void)
+{
+	if (lorawan_config.adaptive_send) {
+		return power_governor_interval(lorawan_config.max_silence_time);
+	}
 
+	return power_governor_interval(lorawan_config.send_repeat_time);
+}
 
 static void update_send_timer(struct s_helium_meteo_ctx *ctx)
 {
-	uint32_t time = lorawan_config.send_repeat_time;
+	uint32_t time = send_interval();
 
 	if (time) {
 		LOG_INF("Send interval timer start for %d sec", time);
 		k_timer_start(&ctx->send_timer,
 				K_SECONDS(time),
 				K_SECONDS(time));
+	} else {
+		k_timer_stop(&ctx->send_timer);
 	}
 }
 
-static void send_timer_handler(struct k_timer *timer)
+/*
+ * Adaptive send only notices a change when sampling, so without a
+ * sample interval of its own it samples at the send interval.
+ */
+static uint32_t sample_interval(void)
 {
-	struct app_evt_t ev;
+	if (lorawan_config.adaptive_send && !lorawan_config.sample_interval) {
+		return power_governor_interval(lorawan_config.send_repeat_time);
+	}
+
+	return power_governor_interval(lorawan_config.sample_interval);
+}
 
-	LOG_INF("Timer handler");
+static void update_sample_timer(struct s_helium_meteo_ctx *ctx)
+{
+	uint32_t time = sample_interval();
 
-	ev.event_type = EV_TIMER;
-	while (k_msgq_put(&event_msgq, &ev, K_NO_WAIT) != 0) {
-		/* message queue is full: purge old data & try again */
-		k_msgq_purge(&event_msgq);
+	if (time) {
+		LOG_INF("Sample interval timer start for %d sec", time);
+		k_timer_start(&ctx->sample_timer,
+				K_SECONDS(time),
+				K_SECONDS(time));
+	} else {
+		k_timer_stop(&ctx->sample_timer);
 	}
 }
 
-static void user_button_pressed(const struct device *dev, struct gpio_callback *cb,
-                    uint32_t pins)
+/* Timer and GPIO callbacks run in ISR context: only post events. */
+static void send_timer_handler(struct k_timer *timer)
+{
+	app_evt_post(EV_TIMER);
+}
+
+static void sample_timer_handler(struct k_timer *timer)
 {
-	struct app_evt_t ev;
+	app_evt_post(EV_SAMPLE);
+}
 
-	LOG_INF("Button handler");
+static void backfill_timer_handler(struct k_timer *timer)
+{
+	app_evt_post(EV_BACKFILL);
+}
 
-	ev.event_type = EV_BUTTON;
-	while (k_msgq_put(&event_msgq, &ev, K_NO_WAIT) != 0) {
-		/* message queue is full: purge old data & try again */
-		k_msgq_purge(&event_msgq);
-	}
+static void user_button_pressed(const struct device *dev, struct gpio_callback *cb,
+                    uint32_t pins)
+{
+	app_evt_post(EV_BUTTON);
 }
 
 
@@ -209,10 +324,35 @@ static void led_enable(const struct gpio_dt_spec *led, int enable)
 static void dl_callback(uint8_t port, uint8_t flags, int16_t rssi, int8_t snr, uint8_t len,
 			const uint8_t *data)
 {
+	struct config_downlink dl;
+	uint32_t gps_s;
+
 	LOG_INF("Port %d, Flags %x, RSSI %ddB, SNR %ddBm", port, flags, rssi, snr);
+	link_quality_downlink(rssi, snr);
+	if ((flags & LORAWAN_TIME_UPDATED) && lorawan_device_time_get(&gps_s) == 0) {
+		clock_sync_answer(gps_s);
+	}
 	if (data) {
 		LOG_HEXDUMP_INF(data, len, "Payload: ");
 	}
+
+	if (port != DOWNLINK_CONFIG_PORT || !data || !len) {
+		return;
+	}
+	if (len > sizeof(dl.data)) {
+		LOG_WRN("Config downlink too long: %u", len);
+		return;
+	}
+
+	/* Called from the LoRaWAN stack, so apply it later. */
+	dl.len = len;
+	memcpy(dl.data, data, len);
+	if (k_msgq_put(&config_downlink_msgq, &dl, K_NO_WAIT)) {
+		LOG_WRN("Config downlink dropped");
+		atomic_inc(&lorawan_status.events_dropped);
+		return;
+	}
+	app_evt_post(EV_CONFIG_DOWNLINK);
 }
 
 static struct lorawan_downlink_cb downlink_cb = {
@@ -226,6 +366,15 @@ static void lorwan_datarate_changed(enum lorawan_datarate dr)
 
 	lorawan_get_payload_sizes(&unused, &max_size);
 	LOG_INF("New Datarate: DR_%d, Max Payload %d", dr, max_size);
+	link_quality_datarate(dr);
+}
+
+static void lora_link_check_ans(uint8_t demod_margin, uint8_t nb_gateways,
+		int16_t rssi, int8_t snr)
+{
+	LOG_INF("Link check: margin %ddB, %d gateways, RSSI %ddB, SNR %ddBm",
+		demod_margin, nb_gateways, rssi, snr);
+	link_quality_check_ans(demod_margin, nb_gateways);
 }
 
 static int init_meteo(struct s_helium_meteo_ctx *ctx)
@@ -262,10 +411,74 @@ static const char *lorawan_state_str(enum lorawan_state_e state)
 	return "UNKNOWN";
 }
 
-static void lorawan_state(struct s_helium_meteo_ctx *ctx, enum lorawan_state_e state)
+/*
+ * With the LoRaMAC NVM, the session keys, frame counters and DevNonce
+ * are kept across reboots. Remember whether there is a joined session
+ * to resume.
+ */
+static void lora_session_save(bool saved)
+{
+	if (!IS_ENABLED(CONFIG_LORAWAN_NVM_SETTINGS) ||
+	    lorawan_config.session_saved == saved) {
+		return;
+	}
+
+	lorawan_config.session_saved = saved;
+	hm_lorawan_nvm_save_settings("session_saved");
+}
+
+static bool lora_session_resumable(void)
+{
+	return IS_ENABLED(CONFIG_LORAWAN_NVM_SETTINGS) &&
+		lorawan_config.auto_join && lorawan_config.session_saved;
+}
+
+/*
+ * The configured data rate, raised by the power profile while the link
+ * margin leaves room for it.
+ */
+static enum lorawan_datarate lora_datarate(struct s_helium_meteo_ctx *ctx)
+{
+	const struct power_profile *profile = power_profile_get(power_governor_current());
+	int margin_db = LORA_POWER_DR_STEP_MARGIN_DB;
+	struct link_quality lq;
+
+	/* Once raised, the margin is smaller by about 2.5 dB a step. */
+	if (ctx->datarate > lorawan_config.data_rate) {
+		margin_db -= 3 * profile->dr_steps;
+	}
+
+	link_quality_get(&lq);
+	if (!profile->dr_steps || lq.margin_db == INT8_MAX || lq.margin_db < margin_db) {
+		return lorawan_config.data_rate;
+	}
+
+	return MIN(lorawan_config.data_rate + profile->dr_steps, LORAWAN_DR_5);
+}
+
+static void lora_update_datarate(struct s_helium_meteo_ctx *ctx)
+{
+	int err;
+
+	ctx->datarate = lora_datarate(ctx);
+	err = lorawan_set_datarate(ctx->datarate);
+	if (err) {
+		LOG_ERR("lorawan_set_datarate failed: %d", err);
+	}
+}
+
+/* Confirmed messages as configured, unless the battery is low. */
+static uint8_t lora_msg_type(void)
 {
-	uint32_t join_try_interval_sec = lorawan_config.join_try_interval;
+	if (!power_profile_get(power_governor_current())->confirmed) {
+		return LORAWAN_MSG_UNCONFIRMED;
+	}
 
+	return lorawan_config.confirmed_msg;
+}
+
+static void lorawan_state(struct s_helium_meteo_ctx *ctx, enum lorawan_state_e state)
+{
 	LOG_INF("LoraWAN state set to: %s", lorawan_state_str(state));
 
 	switch (state) {
@@ -275,17 +488,20 @@ static void lorawan_state(struct s_helium_meteo_ctx *ctx, enum lorawan_state_e s
 			break;
 		}
 		lorawan_status.joined = false;
-		LOG_INF("Lora join timer start for %d sec", join_try_interval_sec);
-		k_timer_start(&ctx->lora_join_timer, K_SECONDS(join_try_interval_sec),
-				K_NO_WAIT);
+		lora_session_save(false);
 		k_sem_give(&ctx->lora_join_sem);
 		break;
 
 	case JOINED:
 		lorawan_status.joined = true;
-		lorawan_status.join_retry_sessions_count = 0;
-		LOG_INF("Stop Lora join retry timer");
-		k_timer_stop(&ctx->lora_join_timer);
+		lorawan_status.msgs_failed = 0;
+		join_sched_reset(&ctx->join_sched);
+		clock_sync_rejoined();
+		link_quality_reset(ctx->datarate);
+		lora_session_save(true);
+		/* Replay samples stored while we were not joined. */
+		k_timer_start(&ctx->backfill_timer, K_SECONDS(LORA_BACKFILL_INTERVAL_SEC),
+				K_NO_WAIT);
 		break;
 
 	default:
@@ -294,25 +510,12 @@ static void lorawan_state(struct s_helium_meteo_ctx *ctx, enum lorawan_state_e s
 	} /* switch */
 }
 
-static void lora_join_timer_handler(struct k_timer *timer)
-{
-	struct s_helium_meteo_ctx *ctx =
-		CONTAINER_OF(timer, struct s_helium_meteo_ctx, lora_join_timer);
-
-	LOG_INF("LoraWAN join timer handler");
-
-	/* If not joined within 'join_try_interval', try again */
-	if (!lorawan_status.joined) {
-		lorawan_state(ctx, NOT_JOINED);
-	}
-}
-
 static int join_lora(struct s_helium_meteo_ctx *ctx)
 {
 	struct pm_policy_latency_request req;
 	struct lorawan_join_config join_cfg;
-	int retry = lorawan_config.join_try_count;
-	int ret = 0;
+	int64_t phase;
+	int ret;
 
 	pm_policy_latency_request_add(&req, 3);
 
@@ -322,21 +525,17 @@ static int join_lora(struct s_helium_meteo_ctx *ctx)
 	join_cfg.otaa.app_key = lorawan_config.app_key;
 	join_cfg.otaa.nwk_key = lorawan_config.app_key;
 
-	if (lorawan_config.auto_join) {
-		while (retry--) {
-			LOG_INF("Joining network over OTAA. Attempt: %d",
-					lorawan_config.join_try_count - retry);
-			ret = lorawan_join(&join_cfg);
-			if (ret == 0) {
-				break;
-			}
-			LOG_ERR("lorawan_join_network failed: %d", ret);
-			k_sleep(K_SECONDS(15));
-		}
-
-		if (ret == 0) {
-			lorawan_state(ctx, JOINED);
-		}
+	LOG_INF("Joining network over OTAA. Attempt: %u", ctx->join_sched.attempts + 1);
+	lorawan_status.join_attempts++;
+	phase = energy_phase_begin();
+	ret = lorawan_join(&join_cfg);
+	energy_phase_end(ENERGY_PHASE_JOIN, phase);
+	if (ret < 0) {
+		LOG_ERR("lorawan_join_network failed: %d", ret);
+	} else {
+		LOG_INF("Joined, %u uAh spent joining since boot",
+			(uint32_t)(lorawan_status.energy.charge_uC[ENERGY_PHASE_JOIN] / 3600));
+		lorawan_state(ctx, JOINED);
 	}
 
 	pm_policy_latency_request_remove(&req);
@@ -344,37 +543,45 @@ static int join_lora(struct s_helium_meteo_ctx *ctx)
 	return ret;
 }
 
+/*
+ * Join until it succeeds, backing off between attempts, see
+ * join_sched.h. Woken up by lorawan_state(NOT_JOINED).
+ */
 static void lora_join_thread(struct s_helium_meteo_ctx *ctx)
 {
-	uint16_t retry_count_conf = lorawan_config.max_join_retry_sessions_count;
-	int err;
+	uint32_t delay_sec;
 
 	while (1) {
 		k_sem_take(&ctx->lora_join_sem, K_FOREVER);
-		err = join_lora(ctx);
-		if (err) {
-			lorawan_status.join_retry_sessions_count++;
-		}
 
-		if (lorawan_status.join_retry_sessions_count > retry_count_conf) {
-			LOG_ERR("Reboot in 30sec");
-			k_sleep(K_SECONDS(30));
-			sys_reboot(SYS_REBOOT_WARM);
-			return; /* won't reach this */
+		/* Devices which lost power or coverage together rejoin apart. */
+		delay_sec = join_sched_start_delay();
+		while (!lorawan_status.joined && lorawan_config.auto_join) {
+			LOG_INF("Next join attempt in %u sec", delay_sec);
+			lorawan_status.join_next_ms = k_uptime_get() + delay_sec * MSEC_PER_SEC;
+			k_sleep(K_SECONDS(delay_sec));
+			if (join_lora(ctx) == 0) {
+				break;
+			}
+			delay_sec = join_sched_failed(&ctx->join_sched, lorawan_config.data_rate);
 		}
+		lorawan_status.join_next_ms = 0;
 	}
 }
 
 static int init_lora(struct s_helium_meteo_ctx *ctx)
 {
-	const struct device *lora_dev;
 	int ret;
 
-	lora_dev = DEVICE_DT_GET(DT_ALIAS(lora0));
+	/* The native_sim loopback backend has no radio. */
+#if DT_HAS_ALIAS(lora0)
+	const struct device *lora_dev = DEVICE_DT_GET(DT_ALIAS(lora0));
+
 	if (!device_is_ready(lora_dev)) {
 		LOG_ERR("%s: device not ready.", lora_dev->name);
 		return -ENODEV;
 	}
+#endif
 
 	ret = lorawan_start();
 	if (ret < 0) {
@@ -384,7 +591,8 @@ static int init_lora(struct s_helium_meteo_ctx *ctx)
 
 	lorawan_register_downlink_callback(&downlink_cb);
 	lorawan_register_dr_changed_callback(lorwan_datarate_changed);
-	lorawan_set_datarate(lorawan_config.data_rate);
+	lorawan_register_link_check_ans_callback(lora_link_check_ans);
+	lora_update_datarate(ctx);
 
 	k_sem_init(&ctx->lora_join_sem, 0, K_SEM_MAX_LIMIT);
 
@@ -396,8 +604,13 @@ static int init_lora(struct s_helium_meteo_ctx *ctx)
 
 	k_thread_name_set(&ctx->thread, "lora_join");
 
-	/* make initial join */
-	lorawan_state(ctx, NOT_JOINED);
+	if (lora_session_resumable()) {
+		LOG_INF("Resuming the saved LoRaWAN session");
+		lorawan_state(ctx, JOINED);
+	} else {
+		/* make initial join */
+		lorawan_state(ctx, NOT_JOINED);
+	}
 
 	return 0;
 }
@@ -405,98 +618,237 @@ static int init_lora(struct s_helium_meteo_ctx *ctx)
 static void init_timers(struct s_helium_meteo_ctx *ctx)
 {
 	k_timer_init(&ctx->send_timer, send_timer_handler, NULL);
-	k_timer_init(&ctx->lora_join_timer, lora_join_timer_handler, NULL);
+	k_timer_init(&ctx->sample_timer, sample_timer_handler, NULL);
+	k_timer_init(&ctx->backfill_timer, backfill_timer_handler, NULL);
 
 	update_send_timer(ctx);
+	update_sample_timer(ctx);
 }
 
-static void send_event(struct s_helium_meteo_ctx *ctx)
+/* Without periodic sampling, uplinks carry a sample taken for them. */
+static bool lora_needs_fresh_sample(void)
 {
-	struct app_evt_t ev;
-
-	if (!lorawan_status.joined) {
-		LOG_WRN("Not joined");
-		return;
-	}
+	return !meteo_samples_count() &&
+		(lorawan_status.joined || IS_ENABLED(CONFIG_FCB));
+}
 
-	if (!lorawan_config.send_repeat_time) {
+static void send_event(struct s_helium_meteo_ctx *ctx)
+{
+	/* Even if not joined, the send path keeps the readings for later. */
+	if (!send_interval()) {
 		LOG_WRN("Periodic send is disabled");
 		return;
 	}
 
-	ev.event_type = EV_SEND_DATA;
-	while (k_msgq_put(&event_msgq, &ev, K_NO_WAIT) != 0) {
-		/* message queue is full: purge old data & try again */
-		k_msgq_purge(&event_msgq);
+	/* Get the conversions going before the send path needs them. */
+	if (ctx->meteo_dev != NULL && lora_needs_fresh_sample()) {
+		meteo_sensor_start(meteo_profile_get(lorawan_config.sensor_profile));
 	}
+
+	app_evt_post(EV_SEND_DATA);
 }
 
-static void lora_send_msg(struct s_helium_meteo_ctx *ctx)
+static void read_meteo(struct s_helium_meteo_ctx *ctx, struct s_meteo_data *data)
 {
-	struct pm_policy_latency_request req;
-	uint8_t msg_type = lorawan_config.confirmed_msg;
-	uint32_t max_failed_msgs = lorawan_config.max_failed_msg;
+	const struct meteo_profile *profile = meteo_profile_get(lorawan_config.sensor_profile);
 	int err;
 
-	if (!lorawan_status.joined) {
-		LOG_WRN("Not joined");
-		return;
+	memset(data, 0, sizeof(*data));
+
+	if (ctx->meteo_dev != NULL) {
+		err = meteo_sensor_finish(profile, data);
+		if (err > 0) {
+			LOG_INF("meteo: %d cCel ; %u Pa ; %u c%%RH (%s, %d reads)\n",
+				data->temp_cCel, data->pressure_Pa, data->humidity_cRH,
+				profile->name, err);
+		} else {
+			LOG_ERR("meteo read failed: %d", err);
+		}
 	}
 
-	pm_policy_latency_request_add(&req, 3);
+#if BATTERY_ENABLED
+	int batt_mV;
+	err = read_battery(&batt_mV);
+	if (err == 0) {
+		data->battery_mV = (uint16_t)batt_mV;
+	}
+#endif
+}
 
-	memset(data_ptr, 0, sizeof(struct s_meteo_data));
+/* Move the samples buffered in RAM to the persistent log. */
+static void store_samples(void)
+{
+#if IS_ENABLED(CONFIG_FCB)
+	struct s_meteo_sample sample;
+	size_t n = 0;
 
-	if (ctx->meteo_dev != NULL) {
-		struct sensor_value temperature, press, humidity;
+	while (meteo_samples_peek(n, &sample) == 0) {
+		if (sample_log_append(&sample)) {
+			break;
+		}
+		n++;
+	}
+	meteo_samples_consume(n);
+
+	LOG_INF("Stored %zu samples, %zu pending in flash", n, sample_log_count());
+#endif
+}
+
+/* Sleeps through the conversions, see meteo_sensor.h */
+static void take_sample(struct s_helium_meteo_ctx *ctx, struct s_meteo_sample *sample)
+{
+	sample->timestamp_s = meteo_samples_time_now();
+	read_meteo(ctx, &sample->data);
+}
 
-		err = sensor_sample_fetch(ctx->meteo_dev);
-		if (err != 0)
-			LOG_ERR("sensor_sample_fetch failed: %d", err);
+static void buffer_sample(const struct s_meteo_sample *sample)
+{
+	/* Rather than overwrite the oldest samples, save them to flash. */
+	if (meteo_samples_count() == METEO_SAMPLES_BUF_SIZE) {
+		store_samples();
+	}
 
-		err = sensor_channel_get(ctx->meteo_dev, SENSOR_CHAN_AMBIENT_TEMP, &temperature);
-		if (err != 0)
-			LOG_ERR("get temperature failed: %d", err);
-		err = sensor_channel_get(ctx->meteo_dev, SENSOR_CHAN_PRESS, &press);
-		if (err != 0)
-			LOG_ERR("get pressure failed: %d", err);
-		err = sensor_channel_get(ctx->meteo_dev, SENSOR_CHAN_HUMIDITY, &humidity);
-		if (err != 0)
-			LOG_ERR("get humidity failed: %d", err);
+	meteo_samples_put(sample);
 
-		LOG_INF("meteo: %d Cel ; %d %%RH\n", temperature.val1, humidity.val1);
+	LOG_DBG("%zu samples buffered", meteo_samples_count());
+}
 
-		/* Celsius to milliKelvin. */
-		meteo_data.temp_mK = (temperature.val1 + 273) * 1000 + (temperature.val2 / 1000 + 150);
-		/* KPa to Pa */
-		meteo_data.pressure_Pa = press.val1 * 1000;
-		/* Both Zephyr and Helium Meteo in percents. */
-		meteo_data.humidity_percent = humidity.val1;
+static void sample_meteo(struct s_helium_meteo_ctx *ctx)
+{
+	struct s_meteo_sample sample;
+
+	take_sample(ctx, &sample);
+	buffer_sample(&sample);
+}
+
+static uint32_t abs_diff(int32_t a, int32_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+static bool adaptive_changed(const struct s_helium_meteo_ctx *ctx,
+		const struct s_meteo_data *data)
+{
+	const struct s_meteo_data *ref = &ctx->adaptive_ref;
+
+	if (!ctx->adaptive_ref_valid) {
+		return true;
+	}
+
+	/* A threshold of zero disables the check for that value. */
+	if (lorawan_config.temp_threshold &&
+	    abs_diff(meteo_units_temp_mK(data->temp_cCel),
+		     meteo_units_temp_mK(ref->temp_cCel)) >= lorawan_config.temp_threshold) {
+		return true;
+	}
+	if (lorawan_config.press_threshold &&
+	    abs_diff(data->pressure_Pa, ref->pressure_Pa) >= lorawan_config.press_threshold) {
+		return true;
+	}
+	if (lorawan_config.humidity_threshold &&
+	    abs_diff(data->humidity_cRH, ref->humidity_cRH) >=
+	    lorawan_config.humidity_threshold * METEO_HUMIDITY_PER_RH) {
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Adaptive send: keep only the samples which moved beyond a threshold
+ * since the last uplink, and send them right away. Otherwise stay
+ * silent until the send timer enforces max_silence_time.
+ */
+static void adaptive_sample_meteo(struct s_helium_meteo_ctx *ctx)
+{
+	struct s_meteo_sample sample;
+
+	take_sample(ctx, &sample);
+
+	if (!adaptive_changed(ctx, &sample.data)) {
+		LOG_DBG("No significant change");
+		return;
 	}
 
-#if IS_ENABLED(CONFIG_ADC)
+	LOG_INF("Significant change, send now");
+	buffer_sample(&sample);
+	app_evt_post(EV_SEND_DATA);
+}
+
+/*
+ * Follow the battery level with the power profile, see
+ * power_governor.h. Called after each uplink, as that is when the
+ * battery gets measured.
+ */
+static void power_governor_apply(struct s_helium_meteo_ctx *ctx)
+{
+#if BATTERY_ENABLED
+	enum power_profile_id prev = power_governor_current();
+	const struct power_profile *profile;
+	unsigned int level_pptt;
 	int batt_mV;
-	err = read_battery(&batt_mV);
-	if (err == 0) {
-		meteo_data.battery_mV = (uint16_t)batt_mV;
+
+	if (read_battery(&batt_mV)) {
+		return;
+	}
+
+	level_pptt = battery_level_pptt(batt_mV, battery_levels);
+	profile = power_profile_get(power_governor_update(level_pptt));
+	if (power_governor_current() != prev) {
+		LOG_WRN("Battery at %u %%: %s power profile", level_pptt / 100, profile->name);
+		update_send_timer(ctx);
+		update_sample_timer(ctx);
+#if IS_ENABLED(CONFIG_SHELL)
+		if (device_is_ready(dev_console) && pm_device_wakeup_is_capable(dev_console)) {
+			pm_device_wakeup_enable(dev_console, profile->shell_wakeup);
+		}
+#endif
+	}
+
+	/* The link margin may have changed, too. */
+	if (lora_datarate(ctx) != ctx->datarate) {
+		lora_update_datarate(ctx);
 	}
 #endif
+}
 
-	LOG_HEXDUMP_DBG(data_ptr, sizeof(struct s_meteo_data),
-			"meteo_data");
+static int lora_send_payload(struct s_helium_meteo_ctx *ctx, uint8_t port,
+		uint8_t *msg, size_t len, uint8_t msg_type)
+{
+	uint32_t max_failed_msgs = lorawan_config.max_failed_msg;
+	int64_t phase;
+	int err;
 
-	/* Send at least one confirmed msg on every 10 to check connectivity */
-	if (msg_type == LORAWAN_MSG_UNCONFIRMED &&
-			!(lorawan_status.msgs_sent % 10)) {
+	/* Confirmed frames only when the link is in doubt, see link_quality.h */
+	switch (link_quality_before_uplink(lorawan_config.max_inactive_time_window,
+					   lorawan_config.auto_join)) {
+	case LINK_ACTION_REJOIN:
+		LOG_ERR("Network silent for %u sec: Try to re-join.",
+			lorawan_config.max_inactive_time_window);
+		lorawan_state(ctx, NOT_JOINED);
+		return -ENOTCONN;
+	case LINK_ACTION_CHECK:
+		LOG_INF("Link in doubt, check it");
+		lorawan_request_link_check(false);
+		break;
+	case LINK_ACTION_CONFIRM:
+		LOG_INF("Link check unanswered or network silent, send confirmed");
 		msg_type = LORAWAN_MSG_CONFIRMED;
+		break;
+	default:
+		break;
 	}
 
-	LOG_INF("Lora send -------------->");
+	/* The DeviceTimeReq rides along, see clock_sync.h */
+	if (clock_sync_before_uplink()) {
+		lorawan_request_device_time(false);
+	}
 
 	led_enable(&dt_led0, 1);
-	err = lorawan_send(lorawan_config.app_port,
-			data_ptr, sizeof(struct s_meteo_data),
-			msg_type);
+	phase = energy_phase_begin();
+	err = lorawan_send(port, msg, len, msg_type);
+	energy_phase_end(ENERGY_PHASE_RADIO, phase);
+	link_quality_after_uplink(msg_type == LORAWAN_MSG_CONFIRMED, err);
 	if (err < 0) {
 		//TODO: make special LED pattern in this case
 		lorawan_status.msgs_failed++;
@@ -508,13 +860,257 @@ static void lora_send_msg(struct s_helium_meteo_ctx *ctx)
 		LOG_INF("Data sent!");
 	}
 	led_enable(&dt_led0, 0);
+#if BATTERY_ENABLED
+	/* The battery still recovers from the transmission, see battery.h */
+	battery_tx_done();
+#endif
+	power_governor_apply(ctx);
 
-	if (lorawan_status.msgs_failed > max_failed_msgs) {
+	if (err == -ENOTCONN) {
+		/* The saved session could not be resumed. */
+		LOG_ERR("No session: Try to re-join.");
+		lorawan_state(ctx, NOT_JOINED);
+	} else if (lorawan_status.msgs_failed > max_failed_msgs) {
 		LOG_ERR("Too many failed msgs: Try to re-join.");
 		lorawan_state(ctx, NOT_JOINED);
-		k_sem_give(&ctx->lora_join_sem);
 	}
+
+	return err;
+}
+
+/* Room for the data payload in an uplink of frame_size bytes. */
+static size_t lora_payload_capacity(size_t frame_size)
+{
+#if IS_ENABLED(CONFIG_TINYCRYPT_AES_CBC)
+	if (lorawan_config.payload_encrypt) {
+		return payload_crypt_capacity(frame_size);
+	}
+#endif
+	return frame_size;
+}
+
+/*
+ * Encrypt a data payload in place, if enabled. Returns the length to
+ * send, or a negative error code.
+ */
+static int lora_encrypt_payload(uint8_t *msg, size_t len, size_t size)
+{
+#if IS_ENABLED(CONFIG_TINYCRYPT_AES_CBC)
+	int ret;
+
+	if (lorawan_config.payload_encrypt) {
+		ret = payload_crypt_encrypt(lorawan_config.payload_key, msg, len, size);
+		if (ret < 0) {
+			LOG_ERR("Payload encryption failed: %d", ret);
+		}
+		return ret;
+	}
+#endif
+	return len;
+}
+
+/* Start an uplink payload for a frame of frame_size bytes. */
+static void lora_payload_init(struct payload_encoder *enc, uint8_t *msg, size_t frame_size)
+{
+	uint32_t gps_offset_s;
+
+	payload_encoder_init(enc, msg, lora_payload_capacity(frame_size),
+			meteo_samples_time_now());
+	if (meteo_samples_gps_offset(&gps_offset_s) == 0) {
+		payload_encoder_set_gps_offset(enc, gps_offset_s);
+	}
+	/* Let the server know why the data gets sparse. */
+	if (power_governor_current() != POWER_PROFILE_NORMAL) {
+		payload_encoder_set_power_profile(enc, power_governor_current());
+	}
+}
+
+/*
+ * Send an empty frame, which only carries the pending MAC commands. It
+ * holds no data, so it does not count as a sent or failed message.
+ */
+static void lora_send_mac_commands(void)
+{
+	int64_t phase;
+	int err;
+
+	LOG_INF("Lora send MAC commands only -------------->");
+
+	led_enable(&dt_led0, 1);
+	phase = energy_phase_begin();
+	err = lorawan_send(0, NULL, 0, LORAWAN_MSG_UNCONFIRMED);
+	energy_phase_end(ENERGY_PHASE_RADIO, phase);
+	led_enable(&dt_led0, 0);
+	if (err < 0) {
+		LOG_ERR("lorawan_send of MAC commands failed: %d", err);
+	}
+}
+
+static void lora_send_msg(struct s_helium_meteo_ctx *ctx)
+{
+	struct pm_policy_latency_request req;
+	struct payload_encoder enc;
+	struct s_meteo_sample sample;
+	uint8_t msg[LORA_MSG_MAX_SIZE];
+	uint8_t msg_type = lora_msg_type();
+	uint8_t max_next_size, max_size;
+	bool fresh_sample = lora_needs_fresh_sample();
+	size_t i;
+	int msg_len, err;
+
+	if (!lorawan_status.joined) {
+		if (fresh_sample) {
+			sample_meteo(ctx);
+		}
+		LOG_WRN("Not joined");
+		store_samples();
+		return;
+	}
+
+	/* Query the stack while the sensor converts, then wait for it. */
+	lorawan_get_payload_sizes(&max_next_size, &max_size);
+	if (fresh_sample) {
+		sample_meteo(ctx);
+	}
+
+	pm_policy_latency_request_add(&req, 3);
+
+	/* Pack as many buffered samples, oldest first, as the
+	 * current data rate allows.
+	 */
+	lora_payload_init(&enc, msg, MIN(max_next_size, sizeof(msg)));
+	for (i = 0; meteo_samples_peek(i, &sample) == 0; i++) {
+		if (payload_encoder_add(&enc, &sample)) {
+			break;
+		}
+	}
+	if (enc.count == 0) {
+		/* Pending MAC commands leave no room. Flush them, and
+		 * send our samples with the next uplink.
+		 */
+		lora_send_mac_commands();
+		pm_policy_latency_request_remove(&req);
+		return;
+	}
+	msg_len = payload_encoder_finish(&enc);
+
+	LOG_HEXDUMP_DBG(msg, msg_len, "meteo_data");
+
+	msg_len = lora_encrypt_payload(msg, msg_len, sizeof(msg));
+	if (msg_len < 0) {
+		pm_policy_latency_request_remove(&req);
+		return;
+	}
+
+	LOG_INF("Lora send %zu samples -------------->", enc.count);
+
+	err = lora_send_payload(ctx, lorawan_config.app_port, msg, msg_len, msg_type);
+	if (err >= 0) {
+		meteo_samples_consume(enc.count);
+
+		ctx->adaptive_ref = enc.prev.data;
+		ctx->adaptive_ref_valid = true;
+		if (lorawan_config.adaptive_send) {
+			/* Count the silence time from this uplink. */
+			update_send_timer(ctx);
+		}
+#if IS_ENABLED(CONFIG_FCB)
+		/* Link is up again: replay samples stored meanwhile. */
+		if (sample_log_count() && !k_timer_remaining_get(&ctx->backfill_timer)) {
+			k_timer_start(&ctx->backfill_timer,
+					K_SECONDS(LORA_BACKFILL_INTERVAL_SEC), K_NO_WAIT);
+		}
+#endif
+	}
+
 	pm_policy_latency_request_remove(&req);
+
+	if (err >= 0 && lorawan_config.energy_report_interval &&
+	    !(lorawan_status.msgs_sent % lorawan_config.energy_report_interval)) {
+		app_evt_post(EV_ENERGY_REPORT);
+	}
+}
+
+static void lora_energy_report_msg(struct s_helium_meteo_ctx *ctx)
+{
+	uint8_t msg[ENERGY_REPORT_MAX_SIZE];
+	size_t msg_len;
+
+	if (!lorawan_status.joined) {
+		return;
+	}
+
+	msg_len = energy_report_encode(msg, sizeof(msg));
+
+	LOG_INF("Lora energy report -------------->");
+	lora_send_payload(ctx, LORA_DIAG_PORT, msg, msg_len, LORAWAN_MSG_UNCONFIRMED);
+}
+
+static void lora_config_downlink(struct s_helium_meteo_ctx *ctx)
+{
+	struct config_downlink dl;
+	int changed;
+
+	while (k_msgq_get(&config_downlink_msgq, &dl, K_NO_WAIT) == 0) {
+		changed = downlink_config_apply(dl.data, dl.len);
+		if (changed < 0) {
+			LOG_WRN("Config downlink rejected: %d", changed);
+			continue;
+		}
+
+		if (changed & DOWNLINK_CHANGED_SEND_TIMER) {
+			update_send_timer(ctx);
+		}
+		if (changed & DOWNLINK_CHANGED_SAMPLE_TIMER) {
+			update_sample_timer(ctx);
+		}
+		if (changed & DOWNLINK_CHANGED_DATA_RATE) {
+			lora_update_datarate(ctx);
+		}
+	}
+}
+
+static void lora_backfill_msg(struct s_helium_meteo_ctx *ctx)
+{
+#if IS_ENABLED(CONFIG_FCB)
+	struct pm_policy_latency_request req;
+	struct payload_encoder enc;
+	uint8_t msg[LORA_MSG_MAX_SIZE];
+	uint8_t max_next_size, max_size;
+	int msg_len, err;
+
+	if (!lorawan_status.joined || !sample_log_count()) {
+		return;
+	}
+
+	pm_policy_latency_request_add(&req, 3);
+
+	lorawan_get_payload_sizes(&max_next_size, &max_size);
+	lora_payload_init(&enc, msg, MIN(max_next_size, sizeof(msg)));
+	if (sample_log_peek_batch(&enc)) {
+		msg_len = payload_encoder_finish(&enc);
+		msg_len = lora_encrypt_payload(msg, msg_len, sizeof(msg));
+	} else {
+		msg_len = -ENODATA;
+	}
+	if (msg_len >= 0) {
+		LOG_INF("Lora backfill %zu of %zu samples -------------->",
+				enc.count, sample_log_count());
+
+		err = lora_send_payload(ctx, lorawan_config.app_port, msg, msg_len,
+				lora_msg_type());
+		if (err >= 0) {
+			sample_log_commit_batch();
+		}
+	}
+
+	pm_policy_latency_request_remove(&req);
+
+	if (lorawan_status.joined && sample_log_count()) {
+		k_timer_start(&ctx->backfill_timer, K_SECONDS(LORA_BACKFILL_INTERVAL_SEC),
+				K_NO_WAIT);
+	}
+#endif
 }
 
 #if IS_ENABLED(CONFIG_SHELL)
@@ -524,6 +1120,11 @@ static void shell_cb(enum shell_cmd_event event, void *data) {
 	switch (event) {
 	case SHELL_CMD_SEND_TIMER:
 		update_send_timer(ctx);
+		/* The sample timer may run at the send interval. */
+		update_sample_timer(ctx);
+		break;
+	case SHELL_CMD_SAMPLE_TIMER:
+		update_sample_timer(ctx);
 		break;
 	case SHELL_CMD_SEND_TIMER_GET:
 		time_t time_st_left = k_timer_remaining_get(&ctx->send_timer);
@@ -536,9 +1137,9 @@ static void shell_cb(enum shell_cmd_event event, void *data) {
 }
 #endif
 
-static void app_evt_handler(struct app_evt_t *ev, struct s_helium_meteo_ctx *ctx)
+static void app_evt_handler(enum evt_t event_type, struct s_helium_meteo_ctx *ctx)
 {
-	switch (ev->event_type) {
+	switch (event_type) {
 	case EV_TIMER:
 		LOG_INF("Event Timer");
 		send_event(ctx);
@@ -553,6 +1154,26 @@ static void app_evt_handler(struct app_evt_t *ev, struct s_helium_meteo_ctx *ctx
 	case EV_SEND_DATA:
 		lora_send_msg(ctx);
 		break;
+
+	case EV_SAMPLE:
+		if (lorawan_config.adaptive_send) {
+			adaptive_sample_meteo(ctx);
+		} else {
+			sample_meteo(ctx);
+		}
+		break;
+
+	case EV_BACKFILL:
+		lora_backfill_msg(ctx);
+		break;
+
+	case EV_ENERGY_REPORT:
+		lora_energy_report_msg(ctx);
+		break;
+
+	case EV_CONFIG_DOWNLINK:
+		lora_config_downlink(ctx);
+		break;
 	default:
 		LOG_ERR("Unknown event");
 		break;
@@ -582,6 +1203,14 @@ int main(void)
 	}
 #endif
 
+#if IS_ENABLED(CONFIG_FCB)
+	ret = sample_log_init();
+	if (ret) {
+		/* Not fatal: samples which can't be sent are lost, as before. */
+		LOG_ERR("Sample log is not available");
+	}
+#endif
+
 	init_timers(ctx);
 
 	ret = init_meteo(ctx);
@@ -611,17 +1240,21 @@ int main(void)
 	if (ret) {
 		LOG_ERR("Rebooting in 30 sec.");
 		k_sleep(K_SECONDS(30));
+#if IS_ENABLED(CONFIG_SETTINGS)
+		/* A config change may still wait to be written. */
+		hm_lorawan_nvm_flush();
+#endif
 		sys_reboot(SYS_REBOOT_WARM);
 		goto fail;
 	}
 
-	while (true) {
-		struct app_evt_t ev;
+	/* A battery low already at boot takes effect right away. */
+	power_governor_apply(ctx);
 
-		LOG_INF("Waiting for events...");
+	while (true) {
+		LOG_DBG("Waiting for events...");
 
-		k_msgq_get(&event_msgq, &ev, K_FOREVER);
-		app_evt_handler(&ev, ctx);
+		app_evt_handler(app_evt_get(), ctx);
 	}
 
 fail:
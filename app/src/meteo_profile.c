@@ -0,0 +1,108 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+
+#include "meteo_profile.h"
+
+static const struct meteo_profile meteo_profiles[METEO_PROFILE_COUNT] = {
+	[METEO_PROFILE_LOW_POWER] = {
+		.name = "low_power",
+		.reads = 1,
+		.filter = METEO_FILTER_NONE,
+	},
+	[METEO_PROFILE_STANDARD] = {
+		.name = "standard",
+		.reads = 4,
+		.filter = METEO_FILTER_TRIMMED_MEAN,
+	},
+	[METEO_PROFILE_HIGH_PRECISION] = {
+		.name = "high_precision",
+		.reads = 16,
+		.filter = METEO_FILTER_EMA,
+		/* Coefficient 4 of the BME280 IIR filter */
+		.ema_shift = 2,
+	},
+};
+
+const struct meteo_profile *meteo_profile_get(uint8_t id)
+{
+	if (id >= METEO_PROFILE_COUNT) {
+		id = METEO_PROFILE_STANDARD;
+	}
+
+	return &meteo_profiles[id];
+}
+
+int meteo_profile_find(const char *name)
+{
+	for (int i = 0; i < METEO_PROFILE_COUNT; i++) {
+		if (!strcmp(meteo_profiles[i].name, name)) {
+			return i;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* Few values, so a plain insertion sort does. */
+static void sort_vals(int32_t *vals, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		int32_t val = vals[i];
+		size_t j = i;
+
+		while (j > 0 && vals[j - 1] > val) {
+			vals[j] = vals[j - 1];
+			j--;
+		}
+		vals[j] = val;
+	}
+}
+
+/*
+ * A median rejects spikes, but throws away most of the reads. Averaging
+ * the middle half keeps the spike rejection, and most of the noise
+ * reduction of a plain mean.
+ */
+static int32_t filter_trimmed_mean(int32_t *vals, size_t n)
+{
+	size_t lo = n / 4;
+	size_t hi = n - n / 4;
+	int64_t sum = 0;
+
+	sort_vals(vals, n);
+	for (size_t i = lo; i < hi; i++) {
+		sum += vals[i];
+	}
+
+	return DIV_ROUND_CLOSEST(sum, (int64_t)(hi - lo));
+}
+
+static int32_t filter_ema(const int32_t *vals, size_t n, uint8_t shift)
+{
+	/* Keep the fraction bits between reads, as the sensor does. */
+	int64_t ema = (int64_t)vals[0] << shift;
+
+	for (size_t i = 1; i < n; i++) {
+		ema += vals[i] - (ema >> shift);
+	}
+
+	return (int32_t)DIV_ROUND_CLOSEST(ema, (int64_t)1 << shift);
+}
+
+int32_t meteo_profile_filter(const struct meteo_profile *profile, int32_t *vals, size_t n)
+{
+	switch (profile->filter) {
+	case METEO_FILTER_TRIMMED_MEAN:
+		return filter_trimmed_mean(vals, n);
+	case METEO_FILTER_EMA:
+		return filter_ema(vals, n, profile->ema_shift);
+	default:
+		return vals[n - 1];
+	}
+}
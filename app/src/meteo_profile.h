@@ -0,0 +1,57 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_METEO_PROFILE_H__
+#define __HELIUM_METEO_METEO_PROFILE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Measurement profiles. Each sample is made of several quick forced
+ * mode reads of the BME280 at 1x oversampling, which are then filtered.
+ * More reads cost more sensor time, and give less noise, much like the
+ * oversampling of the sensor itself.
+ */
+enum meteo_filter {
+	/* Use the last read */
+	METEO_FILTER_NONE,
+	/* Trimmed mean: mean of the middle half of the sorted reads */
+	METEO_FILTER_TRIMMED_MEAN,
+	/* Exponential moving average, like the sensor's IIR filter */
+	METEO_FILTER_EMA,
+};
+
+enum meteo_profile_id {
+	METEO_PROFILE_LOW_POWER,
+	METEO_PROFILE_STANDARD,
+	METEO_PROFILE_HIGH_PRECISION,
+	METEO_PROFILE_COUNT,
+};
+
+#define METEO_PROFILE_MAX_READS 16
+
+struct meteo_profile {
+	const char *name;
+	/* Forced mode reads per sample */
+	uint8_t reads;
+	enum meteo_filter filter;
+	/* Each read weighs 1 / 2^ema_shift in the EMA */
+	uint8_t ema_shift;
+};
+
+/* Profile with the given id, or the standard one if there is none. */
+const struct meteo_profile *meteo_profile_get(uint8_t id);
+
+/* Returns the id of the named profile, or -EINVAL. */
+int meteo_profile_find(const char *name);
+
+/*
+ * Combine n reads of one value, as the profile says. The reads may be
+ * reordered.
+ */
+int32_t meteo_profile_filter(const struct meteo_profile *profile, int32_t *vals, size_t n);
+
+#endif /* __HELIUM_METEO_METEO_PROFILE_H__ */
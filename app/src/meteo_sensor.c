@@ -0,0 +1,178 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/rtio/rtio.h>
+
+#include "energy.h"
+#include "meteo_sensor.h"
+#include "meteo_units.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(helium_meteo_sensor);
+
+#define METEO_SENSOR_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(bosch_bme280)
+
+/* Room for one encoded BME280 read. */
+#define METEO_SENSOR_FRAME_SIZE 48
+
+SENSOR_DT_READ_IODEV(meteo_iodev, METEO_SENSOR_NODE,
+		     {SENSOR_CHAN_AMBIENT_TEMP, 0},
+		     {SENSOR_CHAN_PRESS, 0},
+		     {SENSOR_CHAN_HUMIDITY, 0});
+
+/* The reads of a sample, and the callback which ends their energy phase. */
+RTIO_DEFINE(meteo_rtio, METEO_PROFILE_MAX_READS + 1, METEO_PROFILE_MAX_READS + 1);
+
+static uint8_t meteo_frames[METEO_PROFILE_MAX_READS][METEO_SENSOR_FRAME_SIZE] __aligned(8);
+
+/* Profile of the queued reads, NULL if there are none. */
+static const struct meteo_profile *meteo_pending;
+static int64_t meteo_phase;
+/* The reads completed, and their energy phase is accounted. */
+static volatile bool meteo_phase_ended;
+
+/*
+ * Runs once the last read of the chain completes. The sensor is only
+ * busy until then, while the caller may still prepare the uplink.
+ */
+static void meteo_sensor_done(struct rtio *r, const struct rtio_sqe *sqe, int result, void *arg0)
+{
+	ARG_UNUSED(r);
+	ARG_UNUSED(sqe);
+	ARG_UNUSED(result);
+	ARG_UNUSED(arg0);
+
+	energy_phase_end(ENERGY_PHASE_SENSOR, meteo_phase);
+	meteo_phase_ended = true;
+}
+
+int meteo_sensor_start(const struct meteo_profile *profile)
+{
+	struct rtio_sqe *sqe = NULL;
+
+	if (meteo_pending) {
+		return -EBUSY;
+	}
+
+	for (int i = 0; i < profile->reads; i++) {
+		sqe = rtio_sqe_acquire(&meteo_rtio);
+		if (sqe == NULL) {
+			rtio_sqe_drop_all(&meteo_rtio);
+			return -ENOMEM;
+		}
+		rtio_sqe_prep_read(sqe, &meteo_iodev, RTIO_PRIO_NORM, meteo_frames[i],
+				   sizeof(meteo_frames[i]), meteo_frames[i]);
+		/* The sensor does one conversion at a time. */
+		sqe->flags |= RTIO_SQE_CHAINED;
+	}
+
+	/* A failed read cancels the callback, see meteo_sensor_finish(). */
+	sqe = rtio_sqe_acquire(&meteo_rtio);
+	if (sqe == NULL) {
+		rtio_sqe_drop_all(&meteo_rtio);
+		return -ENOMEM;
+	}
+	rtio_sqe_prep_callback(sqe, meteo_sensor_done, NULL, NULL);
+
+	meteo_phase = energy_phase_begin();
+	meteo_phase_ended = false;
+	meteo_pending = profile;
+	rtio_submit(&meteo_rtio, 0);
+
+	return 0;
+}
+
+/* Decode one channel of a read, in 1/per_unit of its unit. */
+static int meteo_sensor_decode(const struct sensor_decoder_api *decoder, const uint8_t *frame,
+			       enum sensor_channel chan, int32_t per_unit, int32_t *val)
+{
+	struct sensor_q31_data q31;
+	uint32_t fit = 0;
+	int ret;
+
+	ret = decoder->decode(frame, (struct sensor_chan_spec){chan, 0}, &fit, 1, &q31);
+	if (ret <= 0) {
+		LOG_ERR("Decoding channel %d failed: %d", chan, ret);
+		return ret < 0 ? ret : -ENODATA;
+	}
+
+	*val = meteo_units_from_q31(q31.readings[0].value, q31.shift, per_unit);
+
+	return 0;
+}
+
+int meteo_sensor_finish(const struct meteo_profile *profile, struct s_meteo_data *data)
+{
+	const struct sensor_decoder_api *decoder;
+	/* Filtered one decimal finer than the samples, then rounded. */
+	int32_t temp_reads[METEO_PROFILE_MAX_READS];
+	int32_t press_reads[METEO_PROFILE_MAX_READS];
+	int32_t humidity_reads[METEO_PROFILE_MAX_READS];
+	size_t n = 0;
+	int err;
+
+	if (!meteo_pending) {
+		err = meteo_sensor_start(profile);
+		if (err) {
+			return err;
+		}
+	}
+	profile = meteo_pending;
+
+	err = sensor_get_decoder(DEVICE_DT_GET(METEO_SENSOR_NODE), &decoder);
+
+	/*
+	 * Every read completes, if only as cancelled after a failed one,
+	 * and so does the callback after them, which has no frame.
+	 */
+	for (int i = 0; i <= profile->reads; i++) {
+		struct rtio_cqe *cqe = rtio_cqe_consume_block(&meteo_rtio);
+		const uint8_t *frame = cqe->userdata;
+		int result = cqe->result;
+
+		rtio_cqe_release(&meteo_rtio, cqe);
+
+		if (frame == NULL) {
+			continue;
+		}
+		if (result < 0) {
+			LOG_ERR("Sensor read failed: %d", result);
+			continue;
+		}
+		if (err ||
+		    meteo_sensor_decode(decoder, frame, SENSOR_CHAN_AMBIENT_TEMP,
+					10 * METEO_TEMP_PER_CEL, &temp_reads[n]) ||
+		    meteo_sensor_decode(decoder, frame, SENSOR_CHAN_PRESS,
+					10 * METEO_PRESS_PER_KPA, &press_reads[n]) ||
+		    meteo_sensor_decode(decoder, frame, SENSOR_CHAN_HUMIDITY,
+					10 * METEO_HUMIDITY_PER_RH, &humidity_reads[n])) {
+			continue;
+		}
+		n++;
+	}
+	if (!meteo_phase_ended) {
+		/* The callback was cancelled. */
+		energy_phase_end(ENERGY_PHASE_SENSOR, meteo_phase);
+	}
+	meteo_pending = NULL;
+
+	if (err) {
+		LOG_ERR("No sensor decoder: %d", err);
+		return err;
+	}
+	if (n == 0) {
+		return -EIO;
+	}
+
+	data->temp_cCel = DIV_ROUND_CLOSEST(meteo_profile_filter(profile, temp_reads, n), 10);
+	data->pressure_Pa = DIV_ROUND_CLOSEST(meteo_profile_filter(profile, press_reads, n), 10);
+	data->humidity_cRH = DIV_ROUND_CLOSEST(meteo_profile_filter(profile, humidity_reads, n), 10);
+
+	return n;
+}
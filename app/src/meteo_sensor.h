@@ -0,0 +1,31 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_METEO_SENSOR_H__
+#define __HELIUM_METEO_METEO_SENSOR_H__
+
+#include "lorawan_config.h"
+#include "meteo_profile.h"
+
+/*
+ * BME280 acquisition through the sensor async API. The reads of a
+ * sample are queued as one RTIO chain, which runs while the caller
+ * gets on with other work, e.g. preparing the uplink. Waiting for the
+ * conversions puts the thread to sleep, without holding a PM latency
+ * request, so the MCU may enter its low power states meanwhile.
+ */
+
+/* Queue the reads of a sample. Returns -EBUSY if they already are. */
+int meteo_sensor_start(const struct meteo_profile *profile);
+
+/*
+ * Wait for the queued reads, or queue them first if there are none,
+ * and filter them as the profile they were queued with says.
+ * Only the temperature, pressure and humidity of data are set.
+ * Returns the number of good reads, or a negative error code.
+ */
+int meteo_sensor_finish(const struct meteo_profile *profile, struct s_meteo_data *data);
+
+#endif /* __HELIUM_METEO_METEO_SENSOR_H__ */
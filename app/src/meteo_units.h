@@ -0,0 +1,61 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_METEO_UNITS_H__
+#define __HELIUM_METEO_METEO_UNITS_H__
+
+#include <stdint.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Fixed-point units of the samples, see struct s_meteo_data, and
+ * conversion of sensor readings to them.
+ */
+
+/* Temperature in 0.01 Cel */
+#define METEO_TEMP_PER_CEL 100
+/* Pressure in Pa, the sensor reports kPa */
+#define METEO_PRESS_PER_KPA 1000
+/* Relative humidity in 0.01 %RH */
+#define METEO_HUMIDITY_PER_RH 100
+
+/* 0 Cel in mK */
+#define METEO_ZERO_CEL_mK 273150
+
+/*
+ * Convert a reading to an integer count of 1/per_unit of its unit,
+ * rounded to the nearest instead of truncated. Works on the micro
+ * units, so the fractional part in val2 is not lost.
+ */
+static inline int32_t meteo_units_from_sensor(const struct sensor_value *val, int32_t per_unit)
+{
+	return (int32_t)DIV_ROUND_CLOSEST(sensor_value_to_micro(val) * per_unit,
+					  (int64_t)1000000);
+}
+
+/*
+ * Same for a reading decoded by the sensor async API, which is
+ * value * 2^shift / 2^31 of its unit.
+ */
+static inline int32_t meteo_units_from_q31(q31_t value, int8_t shift, int32_t per_unit)
+{
+	int64_t scaled = (int64_t)value * per_unit;
+	int frac_bits = 31 - shift;
+
+	if (frac_bits <= 0) {
+		return (int32_t)(scaled << -frac_bits);
+	}
+
+	return (int32_t)((scaled + BIT64(frac_bits - 1)) >> frac_bits);
+}
+
+/* Temperature in mK, as used by the adaptive send threshold. */
+static inline int32_t meteo_units_temp_mK(int16_t temp_cCel)
+{
+	return temp_cCel * (1000 / METEO_TEMP_PER_CEL) + METEO_ZERO_CEL_mK;
+}
+
+#endif /* __HELIUM_METEO_METEO_UNITS_H__ */
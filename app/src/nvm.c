@@ -1,13 +1,97 @@
-
 #include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
 #include <zephyr/settings/settings.h>
+#include <zephyr/sys/crc.h>
 
 #include "lorawan_config.h"
+#include "nvm.h"
 
 #define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(helium_meteo_nvm);
 
+/*
+ * The whole configuration is kept as a single settings record, with a
+ * version and a CRC. Changes are written back after a delay, so that
+ * a burst of shell commands or downlink settings takes a single flash
+ * write.
+ */
+#define HM_CONFIG_RECORD_NAME "helium_meteo/config"
+#define HM_CONFIG_RECORD_VERSION 2
+#define HM_CONFIG_SAVE_DELAY_SEC 5
+
+/*
+ * Fields of the config record, in record order. Each is stored with
+ * its size and no padding, so the record does not depend on the
+ * layout of struct s_lorawan_config. New fields are only appended, and
+ * an older, shorter record leaves them at their defaults. Changing the
+ * size or meaning of a field needs a new HM_CONFIG_RECORD_VERSION.
+ */
+#define HM_CONFIG_FIELDS(X)		\
+	X(dev_eui)			\
+	X(app_eui)			\
+	X(app_key)			\
+	X(lora_mode)			\
+	X(data_rate)			\
+	X(lora_class)			\
+	X(confirmed_msg)		\
+	X(app_port)			\
+	X(auto_join)			\
+	X(send_repeat_time)		\
+	X(sample_interval)		\
+	X(adaptive_send)		\
+	X(temp_threshold)		\
+	X(press_threshold)		\
+	X(humidity_threshold)		\
+	X(max_silence_time)		\
+	X(max_inactive_time_window)	\
+	X(max_failed_msg)		\
+	X(energy_current_uA)		\
+	X(battery_capacity_mAh)		\
+	X(energy_report_interval)	\
+	X(payload_encrypt)		\
+	X(payload_key)			\
+	X(sensor_profile)		\
+	X(session_saved)
+
+#define HM_CONFIG_FIELD_SIZE(_member) sizeof(((struct s_lorawan_config *)0)->_member)
+
+struct hm_config_field {
+	size_t size;
+	off_t offset;
+};
+
+#define HM_CONFIG_FIELD(_member)						\
+	{									\
+		.offset = offsetof(struct s_lorawan_config, _member),		\
+		.size = HM_CONFIG_FIELD_SIZE(_member),				\
+	},
+
+static const struct hm_config_field hm_config_fields[] = {
+	HM_CONFIG_FIELDS(HM_CONFIG_FIELD)
+};
+
+#define HM_CONFIG_FIELD_SIZE_ADD(_member) + HM_CONFIG_FIELD_SIZE(_member)
+#define HM_CONFIG_DATA_SIZE (0 HM_CONFIG_FIELDS(HM_CONFIG_FIELD_SIZE_ADD))
+
+/* Pins the layout of this version: a field changed or was appended. */
+BUILD_ASSERT(HM_CONFIG_DATA_SIZE == 109,
+	     "Config record layout changed, see HM_CONFIG_FIELDS");
+
+struct hm_config_record {
+	uint16_t version;
+	/* Size of the config data which follows */
+	uint16_t size;
+	/* crc32_ieee() of the config data */
+	uint32_t crc;
+	uint8_t data[HM_CONFIG_DATA_SIZE];
+} __packed;
+
+/*
+ * Before the config record, each field was stored as a key of its own
+ * under this base. They are only read once, to migrate them.
+ */
 #define HELIUM_METEO_SETTINGS_BASE "helium_meteo/nvm"
 
 struct hm_nvm_setting_descr {
@@ -31,33 +115,25 @@ static const struct hm_nvm_setting_descr hm_nvm_setting_descriptors[] = {
 	HM_NVM_SETTING_DESCR(app_eui),
 	HM_NVM_SETTING_DESCR(app_key),
 	HM_NVM_SETTING_DESCR(confirmed_msg),
+	HM_NVM_SETTING_DESCR(data_rate),
 	HM_NVM_SETTING_DESCR(auto_join),
 	HM_NVM_SETTING_DESCR(send_repeat_time),
+	HM_NVM_SETTING_DESCR(sample_interval),
+	HM_NVM_SETTING_DESCR(adaptive_send),
+	HM_NVM_SETTING_DESCR(temp_threshold),
+	HM_NVM_SETTING_DESCR(press_threshold),
+	HM_NVM_SETTING_DESCR(humidity_threshold),
+	HM_NVM_SETTING_DESCR(max_silence_time),
+	HM_NVM_SETTING_DESCR(max_inactive_time_window),
+	HM_NVM_SETTING_DESCR(energy_current_uA),
+	HM_NVM_SETTING_DESCR(battery_capacity_mAh),
+	HM_NVM_SETTING_DESCR(energy_report_interval),
+	HM_NVM_SETTING_DESCR(payload_encrypt),
+	HM_NVM_SETTING_DESCR(payload_key),
+	HM_NVM_SETTING_DESCR(sensor_profile),
+	HM_NVM_SETTING_DESCR(session_saved),
 };
 
-void hm_lorawan_nvm_save_settings(const char *name)
-{
-	LOG_DBG("Saving LoRaWAN settings");
-
-	struct s_lorawan_config *nvm = (void *)&lorawan_config;
-
-	for (uint32_t i = 0; i < ARRAY_SIZE(hm_nvm_setting_descriptors); i++) {
-		const struct hm_nvm_setting_descr *descr =
-			&hm_nvm_setting_descriptors[i];
-
-		if (!strncmp(descr->name, name, strlen(name))) {
-			LOG_DBG("Saving configuration %s", descr->setting_name);
-			int err = settings_save_one(descr->setting_name,
-						(char *)nvm + descr->offset,
-						descr->size);
-			if (err) {
-				LOG_ERR("Could not save settings %s, err: %d",
-					descr->name, err);
-			}
-		}
-	}
-}
-
 static int hm_load_setting(void *tgt, size_t tgt_size,
 			const char *key, size_t len,
 			settings_read_cb read_cb, void *cb_arg)
@@ -88,7 +164,8 @@ static int hm_on_setting_loaded(const char *key, size_t len,
 			   void *cb_arg, void *param)
 {
 	int err = 0;
-	struct s_lorawan_config *nvm = param;
+	struct s_lorawan_config *nvm = &lorawan_config;
+	size_t *loaded = param;
 
 	LOG_DBG("Key: %s", key);
 
@@ -102,6 +179,8 @@ static int hm_on_setting_loaded(const char *key, size_t len,
 				descr->size, key, len, read_cb, cb_arg);
 			if (err) {
 				LOG_ERR("Could not read setting %s", descr->name);
+			} else {
+				(*loaded)++;
 			}
 			return err;
 		}
@@ -112,19 +191,183 @@ static int hm_on_setting_loaded(const char *key, size_t len,
 	return err;
 }
 
-int config_nvm_data_restore(void)
+static int hm_config_record_write(void)
 {
-	int err = 0;
+	struct hm_config_record rec = {
+		.version = HM_CONFIG_RECORD_VERSION,
+		.size = sizeof(rec.data),
+	};
+	size_t pos = 0;
+	int err;
 
-	LOG_DBG("Restoring helium_meteo config settings");
+	for (size_t i = 0; i < ARRAY_SIZE(hm_config_fields); i++) {
+		const struct hm_config_field *field = &hm_config_fields[i];
+
+		memcpy(&rec.data[pos], (const uint8_t *)&lorawan_config + field->offset,
+		       field->size);
+		pos += field->size;
+	}
+	rec.crc = crc32_ieee(rec.data, sizeof(rec.data));
+
+	LOG_DBG("Saving config record");
+	err = settings_save_one(HM_CONFIG_RECORD_NAME, &rec, sizeof(rec));
+	if (err) {
+		LOG_ERR("Could not save config, err: %d", err);
+	}
+
+	return err;
+}
+
+static void hm_config_save_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	hm_config_record_write();
+}
+
+static K_WORK_DELAYABLE_DEFINE(hm_config_save_work, hm_config_save_handler);
+
+void hm_lorawan_nvm_save_settings(const char *name)
+{
+	LOG_DBG("Config %s changed, saving in %d sec", name, HM_CONFIG_SAVE_DELAY_SEC);
+
+	/* Each change pushes the write back, so a burst of them is written once. */
+	k_work_reschedule(&hm_config_save_work, K_SECONDS(HM_CONFIG_SAVE_DELAY_SEC));
+}
+
+void hm_lorawan_nvm_flush(void)
+{
+	struct k_work_sync sync;
+
+	if (k_work_cancel_delayable_sync(&hm_config_save_work, &sync)) {
+		hm_config_record_write();
+	}
+}
+
+struct hm_config_record_load {
+	struct hm_config_record rec;
+	ssize_t len;
+};
+
+static int hm_on_record_loaded(const char *key, size_t len,
+			       settings_read_cb read_cb,
+			       void *cb_arg, void *param)
+{
+	struct hm_config_record_load *load = param;
+
+	if (len > sizeof(load->rec)) {
+		LOG_ERR("Config record too long: %zu", len);
+		load->len = -EINVAL;
+		return 0;
+	}
+
+	load->len = read_cb(cb_arg, &load->rec, len);
+
+	return 0;
+}
+
+/*
+ * Copy the fields of a record of this version, or of an older one
+ * which is a prefix of it. A record of another layout would be
+ * converted here, field by field.
+ */
+static int hm_config_record_migrate(const struct hm_config_record *rec, size_t size)
+{
+	size_t pos = 0;
+
+	if (rec->version != HM_CONFIG_RECORD_VERSION) {
+		LOG_ERR("Config record version %u is not supported", rec->version);
+		return -ENOTSUP;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(hm_config_fields); i++) {
+		const struct hm_config_field *field = &hm_config_fields[i];
+
+		if (size - pos < field->size) {
+			break;
+		}
+		memcpy((uint8_t *)&lorawan_config + field->offset, &rec->data[pos], field->size);
+		pos += field->size;
+	}
+
+	return 0;
+}
+
+static int hm_config_record_restore(void)
+{
+	struct hm_config_record_load load = { .len = -ENOENT };
+	size_t size;
+	int err;
+
+	err = settings_load_subtree_direct(HM_CONFIG_RECORD_NAME, hm_on_record_loaded, &load);
+	if (err) {
+		return err;
+	}
+	if (load.len < 0) {
+		return load.len;
+	}
+
+	if (load.len < (ssize_t)offsetof(struct hm_config_record, data)) {
+		LOG_ERR("Config record truncated");
+		return -EINVAL;
+	}
+	size = load.len - offsetof(struct hm_config_record, data);
+	if (load.rec.size != size) {
+		LOG_ERR("Config record size mismatch");
+		return -EINVAL;
+	}
+	if (crc32_ieee(load.rec.data, size) != load.rec.crc) {
+		LOG_ERR("Config record CRC mismatch");
+		return -EBADMSG;
+	}
+
+	return hm_config_record_migrate(&load.rec, size);
+}
+
+/* Move the settings stored one key per field into the config record. */
+static int hm_config_legacy_migrate(void)
+{
+	size_t loaded = 0;
+	int err;
 
 	err = settings_load_subtree_direct(HELIUM_METEO_SETTINGS_BASE,
-					   hm_on_setting_loaded,
-					   (void *)&lorawan_config);
+					   hm_on_setting_loaded, &loaded);
 	if (err) {
 		LOG_ERR("Could not load config settings, err %d", err);
 		return err;
 	}
+	if (!loaded) {
+		return 0;
+	}
+
+	LOG_INF("Migrating %zu settings to the config record", loaded);
+	err = hm_config_record_write();
+	if (err) {
+		return err;
+	}
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(hm_nvm_setting_descriptors); i++) {
+		settings_delete(hm_nvm_setting_descriptors[i].setting_name);
+	}
+
+	return 0;
+}
+
+int config_nvm_data_restore(void)
+{
+	int err;
+
+	LOG_DBG("Restoring helium_meteo config settings");
+
+	err = hm_config_record_restore();
+	if (err == -ENOENT) {
+		return hm_config_legacy_migrate();
+	}
+	if (err) {
+		/* Keep the defaults, rather than a damaged config. */
+		LOG_ERR("Could not restore config, err %d", err);
+		return 0;
+	}
 
 	LOG_DBG("config setings restored");
 
@@ -150,4 +393,3 @@ int load_config(void)
 
 	return err;
 }
-
@@ -6,8 +6,15 @@
 #ifndef __HELIUM_METEO_NVM_H__
 #define __HELIUM_METEO_NVM_H__
 
+/*
+ * Save the config, after the named field changed. The write is
+ * deferred by a few seconds, so that more changes go along with it.
+ */
 void hm_lorawan_nvm_save_settings(const char *name);
 
+/* Write a pending config change now. Call it before any sys_reboot(). */
+void hm_lorawan_nvm_flush(void);
+
 int load_config(void);
 
 #endif /* __HELIUM_METEO_NVM_H__ */
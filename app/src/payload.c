@@ -0,0 +1,140 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+
+#include "payload.h"
+
+/* Five fields, each at most five bytes as a 32-bit varint. */
+#define PAYLOAD_SAMPLE_MAX_SIZE (5 * 5)
+
+size_t payload_put_uvarint(uint8_t *buf, uint32_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		buf[n++] = (uint8_t)(val | 0x80);
+		val >>= 7;
+	}
+	buf[n++] = (uint8_t)val;
+
+	return n;
+}
+
+static size_t put_svarint(uint8_t *buf, int32_t val)
+{
+	/* Zigzag: small negative numbers become small positive ones. */
+	return payload_put_uvarint(buf, ((uint32_t)val << 1) ^ (uint32_t)(val >> 31));
+}
+
+void payload_encoder_init(struct payload_encoder *enc, uint8_t *buf, size_t size,
+			  uint32_t now_s)
+{
+	enc->buf = buf;
+	enc->size = size;
+	enc->len = PAYLOAD_HEADER_SIZE;
+	enc->count = 0;
+	enc->now_s = now_s;
+	enc->power_profile = 0;
+	enc->gps_time = false;
+	enc->gps_offset_s = 0;
+	enc->untimed = false;
+	memset(&enc->prev, 0, sizeof(enc->prev));
+}
+
+void payload_encoder_set_power_profile(struct payload_encoder *enc, uint8_t profile)
+{
+	if (!enc->power_profile) {
+		enc->len++;
+	}
+	enc->power_profile = profile;
+}
+
+void payload_encoder_set_gps_offset(struct payload_encoder *enc, uint32_t offset_s)
+{
+	enc->gps_time = true;
+	enc->gps_offset_s = offset_s;
+}
+
+void payload_encoder_set_untimed(struct payload_encoder *enc)
+{
+	enc->untimed = true;
+}
+
+int payload_encoder_add(struct payload_encoder *enc, const struct s_meteo_sample *sample)
+{
+	const struct s_meteo_data *data = &sample->data;
+	const struct s_meteo_data *prev = &enc->prev.data;
+	uint8_t tmp[PAYLOAD_SAMPLE_MAX_SIZE];
+	size_t n = 0;
+
+	if (enc->count >= PAYLOAD_MAX_SAMPLES) {
+		return -ENOSPC;
+	}
+
+	if (enc->untimed) {
+		/* Logged before a reboot: the time the device was off is unknown. */
+	} else if (enc->count == 0 && enc->gps_time) {
+		/* Absolute time, so that resends and delays do not skew it */
+		n += payload_put_uvarint(&tmp[n], sample->timestamp_s + enc->gps_offset_s);
+	} else if (enc->count == 0) {
+		n += payload_put_uvarint(&tmp[n], enc->now_s > sample->timestamp_s ?
+					  enc->now_s - sample->timestamp_s : 0);
+	} else {
+		n += payload_put_uvarint(&tmp[n], sample->timestamp_s > enc->prev.timestamp_s ?
+					  sample->timestamp_s - enc->prev.timestamp_s : 0);
+	}
+
+	if (enc->count == 0) {
+		n += put_svarint(&tmp[n], data->temp_cCel);
+		n += payload_put_uvarint(&tmp[n], data->pressure_Pa);
+		n += payload_put_uvarint(&tmp[n], data->humidity_cRH);
+		n += payload_put_uvarint(&tmp[n], data->battery_mV);
+	} else {
+		n += put_svarint(&tmp[n], (int32_t)data->temp_cCel - (int32_t)prev->temp_cCel);
+		n += put_svarint(&tmp[n], (int32_t)(data->pressure_Pa - prev->pressure_Pa));
+		n += put_svarint(&tmp[n], (int32_t)data->humidity_cRH -
+					  (int32_t)prev->humidity_cRH);
+		n += put_svarint(&tmp[n], (int32_t)data->battery_mV -
+					  (int32_t)prev->battery_mV);
+	}
+
+	if (enc->len + n > enc->size) {
+		return -ENOSPC;
+	}
+
+	memcpy(&enc->buf[enc->len], tmp, n);
+	enc->len += n;
+	enc->count++;
+	enc->prev = *sample;
+
+	return 0;
+}
+
+size_t payload_encoder_finish(struct payload_encoder *enc)
+{
+	if (enc->len > enc->size) {
+		return 0;
+	}
+
+	enc->buf[0] = PAYLOAD_FMT_V3;
+	enc->buf[1] = (uint8_t)enc->count;
+	if (enc->untimed) {
+		enc->buf[0] |= PAYLOAD_FLAG_UNTIMED;
+	} else {
+		enc->buf[0] |= PAYLOAD_FLAG_AGE;
+		if (enc->gps_time) {
+			enc->buf[0] |= PAYLOAD_FLAG_TIME;
+		}
+	}
+	if (enc->power_profile) {
+		enc->buf[0] |= PAYLOAD_FLAG_POWER;
+		enc->buf[2] = enc->power_profile;
+	}
+
+	return enc->len;
+}
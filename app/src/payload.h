@@ -0,0 +1,96 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_PAYLOAD_H__
+#define __HELIUM_METEO_PAYLOAD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "samples.h"
+
+/*
+ * Compact uplink format. The first byte identifies the format,
+ * the second one holds the number of samples that follow:
+ *
+ *   [format id][count][sample 0][delta 1]...[delta count-1]
+ *
+ * Sample 0 is the oldest one, encoded as varints: unsigned age_s,
+ * zigzag temp_cCel, unsigned pressure_Pa, humidity_cRH and battery_mV,
+ * in the units of meteo_units.h. Its age is counted in seconds back
+ * from the time of sending. Each following sample is encoded as the
+ * unsigned varint number of seconds since the previous sample,
+ * followed by zigzag varint deltas of the remaining fields against the
+ * previous sample.
+ *
+ * The low nibble of the format id holds flags. Without
+ * PAYLOAD_FLAG_AGE, the age fields are omitted. With PAYLOAD_FLAG_POWER,
+ * the header has a third byte, the enum power_profile_id the device
+ * runs in. It is only sent when that is not the normal one. With
+ * PAYLOAD_FLAG_TIME, sample 0 carries its GPS time in seconds instead
+ * of its age. It is set once the device time is synced to the network,
+ * see clock_sync.h. PAYLOAD_FLAG_UNTIMED is set instead of
+ * PAYLOAD_FLAG_AGE for samples logged before a reboot, as the time the
+ * device was off is unknown. They carry no time fields.
+ *
+ * PAYLOAD_FMT_V2, sent by older firmware, is the same except for the
+ * temperature, an unsigned temp_mK, and the humidity in whole percents.
+ */
+#define PAYLOAD_FMT_V2 0x20
+#define PAYLOAD_FMT_V3 0x30
+#define PAYLOAD_FLAG_AGE 0x01
+#define PAYLOAD_FLAG_POWER 0x02
+#define PAYLOAD_FLAG_TIME 0x04
+#define PAYLOAD_FLAG_UNTIMED 0x08
+
+#define PAYLOAD_HEADER_SIZE 2
+#define PAYLOAD_MAX_SAMPLES UINT8_MAX
+
+struct payload_encoder {
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	size_t count;
+	uint32_t now_s;
+	/* Power profile, 0 to leave it out */
+	uint8_t power_profile;
+	/* Sample 0 is sent with its GPS time, device time plus gps_offset_s */
+	bool gps_time;
+	uint32_t gps_offset_s;
+	/* The samples are sent without their time */
+	bool untimed;
+	struct s_meteo_sample prev;
+};
+
+/* Sample ages are computed relative to now_s, in device time. */
+void payload_encoder_init(struct payload_encoder *enc, uint8_t *buf, size_t size,
+			  uint32_t now_s);
+
+/* Report a power profile in the header. Call before adding samples. */
+void payload_encoder_set_power_profile(struct payload_encoder *enc, uint8_t profile);
+
+/*
+ * Send an absolute timestamp, the device time of sample 0 plus
+ * offset_s, see meteo_samples_gps_offset(). Call before adding samples.
+ */
+void payload_encoder_set_gps_offset(struct payload_encoder *enc, uint32_t offset_s);
+
+/* Leave out the time of the samples. Call before adding samples. */
+void payload_encoder_set_untimed(struct payload_encoder *enc);
+
+/*
+ * Append a sample to the payload. Returns -ENOSPC, leaving the
+ * payload intact, if the sample does not fit.
+ */
+int payload_encoder_add(struct payload_encoder *enc, const struct s_meteo_sample *sample);
+
+/* Finalize the header. Returns the payload length in bytes. */
+size_t payload_encoder_finish(struct payload_encoder *enc);
+
+/* Encode an unsigned varint. Returns the number of bytes written. */
+size_t payload_put_uvarint(uint8_t *buf, uint32_t val);
+
+#endif /* __HELIUM_METEO_PAYLOAD_H__ */
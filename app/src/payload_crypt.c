@@ -0,0 +1,63 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/random/random.h>
+#include <tinycrypt/aes.h>
+#include <tinycrypt/cbc_mode.h>
+#include <tinycrypt/constants.h>
+
+#include "payload_crypt.h"
+
+/* Largest LoRaWAN application payload, less the IV. */
+#define PAYLOAD_CRYPT_MAX_SIZE (242 - PAYLOAD_CRYPT_BLOCK_SIZE)
+
+size_t payload_crypt_capacity(size_t frame_size)
+{
+	size_t blocks = frame_size / PAYLOAD_CRYPT_BLOCK_SIZE;
+
+	/* One block for the IV, and at least one byte of padding. */
+	if (blocks < 2) {
+		return 0;
+	}
+
+	return (blocks - 1) * PAYLOAD_CRYPT_BLOCK_SIZE - 1;
+}
+
+int payload_crypt_encrypt(const uint8_t *key, uint8_t *buf, size_t len, size_t size)
+{
+	struct tc_aes_key_sched_struct sched;
+	uint8_t padded[PAYLOAD_CRYPT_MAX_SIZE];
+	uint8_t iv[PAYLOAD_CRYPT_BLOCK_SIZE];
+	size_t pad = PAYLOAD_CRYPT_BLOCK_SIZE - len % PAYLOAD_CRYPT_BLOCK_SIZE;
+	int err;
+
+	if (len + pad > sizeof(padded) || len + pad + sizeof(iv) > size) {
+		return -ENOSPC;
+	}
+
+	memcpy(padded, buf, len);
+	memset(&padded[len], pad, pad);
+
+	/* CBC needs an unpredictable IV, not just a unique one. */
+	err = sys_csrand_get(iv, sizeof(iv));
+	if (err) {
+		return err;
+	}
+
+	if (tc_aes128_set_encrypt_key(&sched, key) != TC_CRYPTO_SUCCESS) {
+		return -EINVAL;
+	}
+
+	/* Writes the IV, followed by the ciphertext. */
+	if (tc_cbc_mode_encrypt(buf, len + pad + sizeof(iv), padded, len + pad,
+				iv, &sched) != TC_CRYPTO_SUCCESS) {
+		return -EIO;
+	}
+
+	return len + pad + sizeof(iv);
+}
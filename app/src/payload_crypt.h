@@ -0,0 +1,37 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_PAYLOAD_CRYPT_H__
+#define __HELIUM_METEO_PAYLOAD_CRYPT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Optional AES-128-CBC encryption of the data uplinks, with the
+ * payload_key from the config. The payload is padded as in PKCS#7,
+ * and sent after a random IV:
+ *
+ *   [IV, 16 bytes][ciphertext, n * 16 bytes]
+ *
+ * This is on top of the LoRaWAN encryption, so that the payload stays
+ * private from the network server too.
+ */
+#define PAYLOAD_CRYPT_BLOCK_SIZE 16
+#define PAYLOAD_CRYPT_KEY_SIZE 16
+
+/*
+ * Largest payload which still fits an uplink of frame_size bytes
+ * once encrypted. Zero if even an empty one does not.
+ */
+size_t payload_crypt_capacity(size_t frame_size);
+
+/*
+ * Encrypt the len byte payload in buf, in place. buf must hold size
+ * bytes. Returns the encrypted length, or a negative error code.
+ */
+int payload_crypt_encrypt(const uint8_t *key, uint8_t *buf, size_t len, size_t size);
+
+#endif /* __HELIUM_METEO_PAYLOAD_CRYPT_H__ */
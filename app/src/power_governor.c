@@ -0,0 +1,81 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+#include "power_governor.h"
+
+/* Level above a band needed to leave its profile again */
+#define POWER_HYSTERESIS_PPTT 500
+
+static const struct power_profile power_profiles[POWER_PROFILE_COUNT] = {
+	[POWER_PROFILE_NORMAL] = {
+		.name = "normal",
+		.enter_pptt = 10000,
+		.interval_factor = 1,
+		.confirmed = true,
+		.dr_steps = 0,
+		.shell_wakeup = true,
+	},
+	[POWER_PROFILE_SAVER] = {
+		.name = "saver",
+		.enter_pptt = 3000,
+		.interval_factor = 2,
+		.confirmed = false,
+		.dr_steps = 0,
+		.shell_wakeup = false,
+	},
+	[POWER_PROFILE_CRITICAL] = {
+		.name = "critical",
+		.enter_pptt = 1000,
+		.interval_factor = 4,
+		.confirmed = false,
+		.dr_steps = 1,
+		.shell_wakeup = false,
+	},
+};
+
+static enum power_profile_id power_current = POWER_PROFILE_NORMAL;
+
+const struct power_profile *power_profile_get(enum power_profile_id id)
+{
+	if (id >= POWER_PROFILE_COUNT) {
+		id = POWER_PROFILE_NORMAL;
+	}
+
+	return &power_profiles[id];
+}
+
+enum power_profile_id power_governor_update(unsigned int level_pptt)
+{
+	enum power_profile_id id = POWER_PROFILE_NORMAL;
+
+	/* The lowest band the level is in */
+	while (id + 1 < POWER_PROFILE_COUNT &&
+	       level_pptt < power_profiles[id + 1].enter_pptt) {
+		id++;
+	}
+
+	/* Going up, the level must clear the band by the hysteresis. */
+	while (id < power_current &&
+	       level_pptt < power_profiles[id + 1].enter_pptt + POWER_HYSTERESIS_PPTT) {
+		id++;
+	}
+
+	power_current = id;
+
+	return id;
+}
+
+enum power_profile_id power_governor_current(void)
+{
+	return power_current;
+}
+
+uint32_t power_governor_interval(uint32_t sec)
+{
+	return sec * power_profiles[power_current].interval_factor;
+}
@@ -0,0 +1,52 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_POWER_GOVERNOR_H__
+#define __HELIUM_METEO_POWER_GOVERNOR_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Battery-aware power profiles. As the battery runs down, the device
+ * sends and samples less often, stops sending confirmed frames and
+ * stops waking up for the shell console, so that it keeps reporting,
+ * sparsely, for longer. A profile is entered when the battery level
+ * falls below its band, and only left once the level is back above the
+ * band by a margin, so that the sag of a cold night does not flip the
+ * profile back and forth.
+ */
+enum power_profile_id {
+	POWER_PROFILE_NORMAL,
+	POWER_PROFILE_SAVER,
+	POWER_PROFILE_CRITICAL,
+	POWER_PROFILE_COUNT,
+};
+
+struct power_profile {
+	const char *name;
+	/* Entered below this battery level, in parts per ten thousand */
+	uint16_t enter_pptt;
+	/* Multiplier of the send and sample intervals */
+	uint8_t interval_factor;
+	/* Send confirmed messages, if so configured */
+	bool confirmed;
+	/* Data rate steps above the configured one, if the link allows */
+	uint8_t dr_steps;
+	/* Keep the shell console a wakeup source */
+	bool shell_wakeup;
+};
+
+const struct power_profile *power_profile_get(enum power_profile_id id);
+
+/* Pick the profile for the battery level. Returns the active profile. */
+enum power_profile_id power_governor_update(unsigned int level_pptt);
+
+enum power_profile_id power_governor_current(void);
+
+/* An interval of the configuration, in seconds, scaled by the profile. */
+uint32_t power_governor_interval(uint32_t sec);
+
+#endif /* __HELIUM_METEO_POWER_GOVERNOR_H__ */
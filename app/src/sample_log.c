@@ -0,0 +1,241 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "sample_log.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(helium_meteo_sample_log);
+
+#define SAMPLE_LOG_AREA_ID DT_FIXED_PARTITION_ID(DT_CHOSEN(hm_sample_log))
+#define SAMPLE_LOG_MAGIC 0x484d534c /* "HMSL" */
+#define SAMPLE_LOG_VERSION 2
+#define SAMPLE_LOG_MAX_SECTORS 64
+
+static struct fcb sample_log_fcb;
+static struct flash_sector sample_log_sectors[SAMPLE_LOG_MAX_SECTORS];
+static bool sample_log_ready;
+
+/*
+ * Last entry which has been sent. A NULL sector means that nothing
+ * has been sent from the oldest sector yet. The position is kept in
+ * RAM only, so after a reboot a partially sent sector is sent again.
+ */
+static struct fcb_entry sample_log_sent;
+static size_t sample_log_unsent;
+
+/*
+ * Samples stamped before this were logged before the last reboot. The
+ * time the device was off is unknown, so they are sent untimed.
+ */
+static uint32_t sample_log_boot_s;
+
+/* Last entry and number of samples in the pending batch. */
+static struct fcb_entry sample_log_batch_end;
+static size_t sample_log_batch_cnt;
+
+static int sample_log_read(const struct fcb_entry *loc, struct s_meteo_sample *sample)
+{
+	if (loc->fe_data_len != sizeof(*sample)) {
+		return -EINVAL;
+	}
+
+	return flash_area_read(sample_log_fcb.fap, FCB_ENTRY_FA_DATA_OFF((*loc)),
+			       sample, sizeof(*sample));
+}
+
+static void sample_log_recount(void)
+{
+	struct fcb_entry loc = sample_log_sent;
+
+	sample_log_unsent = 0;
+	while (fcb_getnext(&sample_log_fcb, &loc) == 0) {
+		sample_log_unsent++;
+	}
+}
+
+static int sample_log_erase(void)
+{
+	const struct flash_area *fa;
+	int err;
+
+	err = flash_area_open(SAMPLE_LOG_AREA_ID, &fa);
+	if (err) {
+		return err;
+	}
+
+	err = flash_area_erase(fa, 0, fa->fa_size);
+	flash_area_close(fa);
+
+	return err;
+}
+
+int sample_log_init(void)
+{
+	struct s_meteo_sample sample;
+	struct fcb_entry loc = { 0 };
+	uint32_t sector_cnt = ARRAY_SIZE(sample_log_sectors);
+	uint32_t last_s = 0;
+	int err;
+
+	err = flash_area_get_sectors(SAMPLE_LOG_AREA_ID, &sector_cnt, sample_log_sectors);
+	if (err) {
+		LOG_ERR("Could not get sample log sectors, err: %d", err);
+		return err;
+	}
+
+	sample_log_fcb.f_magic = SAMPLE_LOG_MAGIC;
+	sample_log_fcb.f_version = SAMPLE_LOG_VERSION;
+	sample_log_fcb.f_sector_cnt = sector_cnt;
+	sample_log_fcb.f_scratch_cnt = 0;
+	sample_log_fcb.f_sectors = sample_log_sectors;
+
+	err = fcb_init(SAMPLE_LOG_AREA_ID, &sample_log_fcb);
+	if (err) {
+		/* Unformatted, corrupt, or written by an incompatible version. */
+		LOG_WRN("Could not init sample log, err: %d. Erasing.", err);
+		err = sample_log_erase();
+		if (!err) {
+			err = fcb_init(SAMPLE_LOG_AREA_ID, &sample_log_fcb);
+		}
+		if (err) {
+			LOG_ERR("Could not init sample log, err: %d", err);
+			return err;
+		}
+	}
+
+	while (fcb_getnext(&sample_log_fcb, &loc) == 0) {
+		if (sample_log_read(&loc, &sample) == 0) {
+			last_s = MAX(last_s, sample.timestamp_s);
+		}
+		sample_log_unsent++;
+	}
+	if (sample_log_unsent) {
+		sample_log_boot_s = last_s + 1;
+	}
+	meteo_samples_time_resume(last_s);
+	sample_log_ready = true;
+
+	LOG_INF("Sample log: %zu samples pending", sample_log_unsent);
+
+	return 0;
+}
+
+int sample_log_append(const struct s_meteo_sample *sample)
+{
+	struct fcb_entry loc;
+	int err;
+
+	if (!sample_log_ready) {
+		return -ENODEV;
+	}
+
+	err = fcb_append(&sample_log_fcb, sizeof(*sample), &loc);
+	if (err == -ENOSPC) {
+		/* Log is full: drop the oldest sector. */
+		if (sample_log_sent.fe_sector == sample_log_fcb.f_oldest) {
+			sample_log_sent.fe_sector = NULL;
+		}
+		err = fcb_rotate(&sample_log_fcb);
+		if (err == 0) {
+			sample_log_recount();
+			err = fcb_append(&sample_log_fcb, sizeof(*sample), &loc);
+		}
+	}
+	if (err) {
+		LOG_ERR("Could not append to sample log, err: %d", err);
+		return err;
+	}
+
+	err = flash_area_write(sample_log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc),
+			       sample, sizeof(*sample));
+	if (err) {
+		LOG_ERR("Could not write sample log, err: %d", err);
+		return err;
+	}
+
+	err = fcb_append_finish(&sample_log_fcb, &loc);
+	if (err) {
+		LOG_ERR("Could not finish sample log entry, err: %d", err);
+		return err;
+	}
+
+	sample_log_unsent++;
+
+	return 0;
+}
+
+size_t sample_log_count(void)
+{
+	return sample_log_unsent;
+}
+
+size_t sample_log_peek_batch(struct payload_encoder *enc)
+{
+	struct s_meteo_sample sample;
+	struct fcb_entry loc = sample_log_sent;
+	bool untimed;
+	int err;
+
+	sample_log_batch_end = sample_log_sent;
+	sample_log_batch_cnt = 0;
+
+	if (!sample_log_ready) {
+		return 0;
+	}
+
+	while (fcb_getnext(&sample_log_fcb, &loc) == 0) {
+		err = sample_log_read(&loc, &sample);
+		if (err == 0) {
+			untimed = sample.timestamp_s < sample_log_boot_s;
+			if (enc->count == 0 && untimed) {
+				payload_encoder_set_untimed(enc);
+			}
+			/* A batch is either all untimed or all timed. */
+			if (untimed != enc->untimed || payload_encoder_add(enc, &sample)) {
+				break;
+			}
+		} else {
+			LOG_WRN("Skipping unreadable sample log entry, err: %d", err);
+		}
+		sample_log_batch_end = loc;
+		sample_log_batch_cnt++;
+	}
+
+	return sample_log_batch_cnt;
+}
+
+void sample_log_commit_batch(void)
+{
+	if (!sample_log_ready) {
+		return;
+	}
+
+	sample_log_sent = sample_log_batch_end;
+	sample_log_unsent -= MIN(sample_log_batch_cnt, sample_log_unsent);
+	sample_log_batch_cnt = 0;
+
+	/* Free the sectors which have been sent completely. */
+	while (sample_log_sent.fe_sector != NULL &&
+	       sample_log_fcb.f_oldest != sample_log_sent.fe_sector) {
+		if (fcb_rotate(&sample_log_fcb)) {
+			return;
+		}
+	}
+
+	/*
+	 * All sent: free the last sector as well, so that a reboot does
+	 * not send it again. Only the sectors in use get erased.
+	 */
+	if (sample_log_unsent == 0 && sample_log_sent.fe_sector != NULL &&
+	    fcb_rotate(&sample_log_fcb) == 0) {
+		sample_log_sent.fe_sector = NULL;
+	}
+}
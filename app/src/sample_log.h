@@ -0,0 +1,39 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_SAMPLE_LOG_H__
+#define __HELIUM_METEO_SAMPLE_LOG_H__
+
+#include <stddef.h>
+
+#include "payload.h"
+#include "samples.h"
+
+/*
+ * Persistent store-and-forward log of samples which could not be sent,
+ * kept in a flash circular buffer on the partition chosen as
+ * hm,sample-log in devicetree. When full, the oldest flash sector
+ * is dropped.
+ */
+int sample_log_init(void);
+
+int sample_log_append(const struct s_meteo_sample *sample);
+
+/* Number of logged samples not yet sent. */
+size_t sample_log_count(void);
+
+/*
+ * Encode the oldest unsent samples until the payload is full. The
+ * samples stay in the log until sample_log_commit_batch() is called.
+ * Samples logged before a reboot get batches of their own, which are
+ * sent untimed, see payload.h. Returns the number of samples in the
+ * batch.
+ */
+size_t sample_log_peek_batch(struct payload_encoder *enc);
+
+/* Mark the samples from the last sample_log_peek_batch() as sent. */
+void sample_log_commit_batch(void);
+
+#endif /* __HELIUM_METEO_SAMPLE_LOG_H__ */
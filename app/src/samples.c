@@ -0,0 +1,105 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+#include "clock_sync.h"
+#include "samples.h"
+
+static struct s_meteo_sample samples_buf[METEO_SAMPLES_BUF_SIZE];
+static size_t samples_head;
+static size_t samples_cnt;
+static struct k_spinlock samples_lock;
+static uint32_t samples_time_base_s;
+
+void meteo_samples_put(const struct s_meteo_sample *sample)
+{
+	k_spinlock_key_t key = k_spin_lock(&samples_lock);
+	size_t tail;
+
+	if (samples_cnt == METEO_SAMPLES_BUF_SIZE) {
+		/* Buffer is full: overwrite the oldest sample. */
+		samples_head = (samples_head + 1) % METEO_SAMPLES_BUF_SIZE;
+		samples_cnt--;
+		lorawan_status.samples_dropped++;
+	}
+
+	tail = (samples_head + samples_cnt) % METEO_SAMPLES_BUF_SIZE;
+	samples_buf[tail] = *sample;
+	samples_cnt++;
+
+	k_spin_unlock(&samples_lock, key);
+}
+
+int meteo_samples_peek(size_t idx, struct s_meteo_sample *sample)
+{
+	k_spinlock_key_t key = k_spin_lock(&samples_lock);
+	int err = 0;
+
+	if (idx < samples_cnt) {
+		*sample = samples_buf[(samples_head + idx) % METEO_SAMPLES_BUF_SIZE];
+	} else {
+		err = -ENOENT;
+	}
+
+	k_spin_unlock(&samples_lock, key);
+
+	return err;
+}
+
+void meteo_samples_consume(size_t n)
+{
+	k_spinlock_key_t key = k_spin_lock(&samples_lock);
+
+	if (n > samples_cnt) {
+		n = samples_cnt;
+	}
+	samples_head = (samples_head + n) % METEO_SAMPLES_BUF_SIZE;
+	samples_cnt -= n;
+
+	k_spin_unlock(&samples_lock, key);
+}
+
+size_t meteo_samples_count(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&samples_lock);
+	size_t n = samples_cnt;
+
+	k_spin_unlock(&samples_lock, key);
+
+	return n;
+}
+
+uint32_t meteo_samples_time_now(void)
+{
+	return samples_time_base_s + (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+}
+
+int meteo_samples_gps_offset(uint32_t *offset_s)
+{
+	uint32_t gps_s;
+	int err;
+
+	err = clock_sync_gps_now(&gps_s);
+	if (err) {
+		return err;
+	}
+
+	/* Modulo 2^32, so that adding it to a timestamp gives the GPS time. */
+	*offset_s = gps_s - meteo_samples_time_now();
+
+	return 0;
+}
+
+void meteo_samples_time_resume(uint32_t last_s)
+{
+	uint32_t now = meteo_samples_time_now();
+
+	if (last_s >= now) {
+		samples_time_base_s += last_s - now + 1;
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_SAMPLES_H__
+#define __HELIUM_METEO_SAMPLES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lorawan_config.h"
+
+/* Number of samples kept in RAM while waiting for the next uplink. */
+#define METEO_SAMPLES_BUF_SIZE 48
+
+struct s_meteo_sample {
+	/* Device time in seconds when the sample was taken */
+	uint32_t timestamp_s;
+	struct s_meteo_data data;
+};
+
+/* Append a sample. If the buffer is full, the oldest sample is dropped. */
+void meteo_samples_put(const struct s_meteo_sample *sample);
+
+/* Copy the idx-th oldest sample, without removing it. */
+int meteo_samples_peek(size_t idx, struct s_meteo_sample *sample);
+
+/* Remove the n oldest samples, e.g. after they have been sent. */
+void meteo_samples_consume(size_t n);
+
+size_t meteo_samples_count(void);
+
+/*
+ * Device time in seconds, used for sample timestamps. It is based on
+ * uptime, but resumed after a reboot from the newest stored sample so
+ * that timestamps never go backwards. It does not step when the time
+ * is synced to the network, so all samples share one time base.
+ */
+uint32_t meteo_samples_time_now(void);
+void meteo_samples_time_resume(uint32_t last_s);
+
+/*
+ * Offset to add to a device time to get the GPS time, see
+ * clock_sync.h. Returns -EAGAIN if not synced to the network yet.
+ */
+int meteo_samples_gps_offset(uint32_t *offset_s);
+
+#endif /* __HELIUM_METEO_SAMPLES_H__ */
@@ -13,10 +13,17 @@
 #include <zephyr/sys/timeutil.h>
 
 #include "lorawan_config.h"
-#if IS_ENABLED(CONFIG_ADC)
+#include "clock_sync.h"
+#include "energy.h"
+#include "link_quality.h"
+#include "meteo_profile.h"
+#include "power_governor.h"
 #include "battery.h"
-#endif
 #include "nvm.h"
+#include "samples.h"
+#if IS_ENABLED(CONFIG_FCB)
+#include "sample_log.h"
+#endif
 #include "shell.h"
 
 #define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
@@ -146,6 +153,15 @@ static int cmd_config(const struct shell *shell, size_t argc, char **argv)
 	shell_print(shell, "  Max failed msgs  %d", lorawan_config.max_failed_msg);
 	shell_print(shell, "  Inactive window  %d sec", lorawan_config.max_inactive_time_window);
 	shell_print(shell, "  Send interval    %d sec", lorawan_config.send_repeat_time);
+	shell_print(shell, "  Sample interval  %d sec", lorawan_config.sample_interval);
+	shell_print(shell, "  Adaptive send    %s", lorawan_config.adaptive_send ? "true" : "false");
+	shell_print(shell, "  Temp threshold   %d mK", lorawan_config.temp_threshold);
+	shell_print(shell, "  Press threshold  %d Pa", lorawan_config.press_threshold);
+	shell_print(shell, "  Hum threshold    %d %%RH", lorawan_config.humidity_threshold);
+	shell_print(shell, "  Max silence      %d sec", lorawan_config.max_silence_time);
+	shell_print(shell, "  Payload encrypt  %s", lorawan_config.payload_encrypt ? "true" : "false");
+	shell_print(shell, "  Sensor profile   %s",
+			meteo_profile_get(lorawan_config.sensor_profile)->name);
 
 	return 0;
 }
@@ -158,10 +174,13 @@ static int cmd_status(const struct shell *shell, size_t argc, char **argv)
 
 	struct timespec tp;
 	struct tm tm;
-	uint16_t join_retry_sessions_count = lorawan_status.join_retry_sessions_count;
+	int64_t join_next_ms = lorawan_status.join_next_ms;
+	int64_t uptime_s = k_uptime_get() / MSEC_PER_SEC;
+	struct link_quality lq;
+	struct clock_sync cs;
+	const struct power_profile *power = power_profile_get(power_governor_current());
 
-	clock_gettime(CLOCK_REALTIME, &tp);
-	gmtime_r(&tp.tv_sec, &tm);
+	clock_sync_get(&cs);
 
 	shell_print(shell, "Device status:");
 	shell_print(shell, "  joined           %s", lorawan_status.joined ? "true" : "false");
@@ -169,20 +188,61 @@ static int cmd_status(const struct shell *shell, size_t argc, char **argv)
 	shell_print(shell, "  messages sent    %d", lorawan_status.msgs_sent);
 	shell_print(shell, "  messages failed  %d", lorawan_status.msgs_failed);
 	shell_print(shell, "  msg failed total %d", lorawan_status.msgs_failed_total);
-	shell_print(shell, "  Join retry sess  %d", join_retry_sessions_count);
-	shell_print(shell, "  Uptime           %04d-%02u-%02u %02u:%02u:%02u",
-		    tm.tm_year - 70,
-		    tm.tm_mon,
-		    tm.tm_mday - 1,
-		    tm.tm_hour,
-		    tm.tm_min,
-		    tm.tm_sec);
+	shell_print(shell, "  join attempts    %u", lorawan_status.join_attempts);
+	if (join_next_ms) {
+		shell_print(shell, "  next join in     %lld sec",
+			    MAX(join_next_ms - k_uptime_get(), 0) / MSEC_PER_SEC);
+	}
+	shell_print(shell, "  join energy      %u uAh",
+		    (uint32_t)(lorawan_status.energy.charge_uC[ENERGY_PHASE_JOIN] / 3600));
+	if (lorawan_status.joined) {
+		link_quality_get(&lq);
+		shell_print(shell, "  network heard    %lld sec ago, %u uplinks since",
+			    (k_uptime_get() - lq.last_heard_ms) / MSEC_PER_SEC, lq.uplinks_unheard);
+		shell_print(shell, "  last downlink    RSSI %ddB, SNR %ddB", lq.rssi, lq.snr);
+		shell_print(shell, "  link margin      %ddB, %u gateways", lq.margin_db, lq.gateways);
+		shell_print(shell, "  link checks      %u, %u confirmed", lq.checks, lq.confirmed);
+	}
+	if (BATTERY_ENABLED && battery_measured_at()) {
+		shell_print(shell, "  power profile    %s, intervals x%u", power->name,
+			    power->interval_factor);
+	} else {
+		/* The power governor needs the battery level. */
+		shell_print(shell, "  power profile    %s, no battery measurement",
+			    power->name);
+	}
+	shell_print(shell, "  samples buffered %zu", meteo_samples_count());
+	shell_print(shell, "  samples dropped  %d", lorawan_status.samples_dropped);
+	shell_print(shell, "  events coalesced %ld", atomic_get(&lorawan_status.events_coalesced));
+	shell_print(shell, "  events dropped   %ld", atomic_get(&lorawan_status.events_dropped));
+#if IS_ENABLED(CONFIG_FCB)
+	shell_print(shell, "  samples in flash %zu", sample_log_count());
+#endif
+	shell_print(shell, "  Uptime           %lld days %02lld:%02lld:%02lld",
+		    uptime_s / 86400, uptime_s / 3600 % 24, uptime_s / 60 % 60, uptime_s % 60);
+	if (cs.synced) {
+		clock_gettime(CLOCK_REALTIME, &tp);
+		gmtime_r(&tp.tv_sec, &tm);
+		shell_print(shell, "  Time             %04d-%02u-%02u %02u:%02u:%02u UTC",
+			    tm.tm_year + 1900,
+			    tm.tm_mon + 1,
+			    tm.tm_mday,
+			    tm.tm_hour,
+			    tm.tm_min,
+			    tm.tm_sec);
+		shell_print(shell, "  time synced      %lld sec ago, %u times, last step %d ms",
+			    (k_uptime_get() - cs.uptime_ms) / MSEC_PER_SEC, cs.answers,
+			    cs.last_step_ms);
+		shell_print(shell, "  clock drift      %d ppb", cs.drift_ppb);
+	} else {
+		shell_print(shell, "  Time             not synced");
+	}
 
 	return 0;
 }
 SHELL_CMD_ARG_REGISTER(status, NULL, "Show helium_meteo status", cmd_status, 1, 0);
 
-#if IS_ENABLED(CONFIG_ADC)
+#if BATTERY_ENABLED
 static int cmd_battery(const struct shell *shell, size_t argc, char **argv)
 {
 	uint16_t batt_pptt;
@@ -197,20 +257,120 @@ static int cmd_battery(const struct shell *shell, size_t argc, char **argv)
 		return err;
 	}
 
-	batt_pptt = battery_level_pptt(batt_mV, levels);
-	shell_print(shell, "Battery: %d mV, %u %%", batt_mV, batt_pptt / 100);
+	batt_pptt = battery_level_pptt(batt_mV, battery_levels);
+	shell_print(shell, "Battery: %d mV, %u %% (measured %lld sec ago)", batt_mV,
+		    batt_pptt / 100, (k_uptime_get() - battery_measured_at()) / MSEC_PER_SEC);
 
 	return 0;
 }
 SHELL_CMD_ARG_REGISTER(battery, NULL, "Show battery status", cmd_battery, 1, 0);
 #endif
 
+static int cmd_energy(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	uint32_t avg_uA = energy_average_uA();
+
+	shell_print(shell, "Energy estimate:");
+	shell_print(shell, "  phase      time s     charge uAh  current uA");
+	for (int i = 0; i < ENERGY_PHASE_COUNT; i++) {
+		shell_print(shell, "  %-10s %-10u %-11u %u", energy_phase_str(i),
+			    (uint32_t)(lorawan_status.energy.time_ms[i] / MSEC_PER_SEC),
+			    (uint32_t)(lorawan_status.energy.charge_uC[i] / 3600),
+			    lorawan_config.energy_current_uA[i]);
+	}
+	shell_print(shell, "  Average current  %u uA", avg_uA);
+	shell_print(shell, "  Battery          %u mAh", lorawan_config.battery_capacity_mAh);
+	if (avg_uA) {
+		shell_print(shell, "  Projected life   %u days",
+			    lorawan_config.battery_capacity_mAh * 1000 / avg_uA / 24);
+	}
+	shell_print(shell, "  Report interval  %u uplinks", lorawan_config.energy_report_interval);
+
+	return 0;
+}
+
+static int cmd_energy_current(const struct shell *shell, size_t argc, char **argv)
+{
+	int phase;
+
+	for (phase = 0; phase < ENERGY_PHASE_COUNT; phase++) {
+		if (!strcmp(argv[1], energy_phase_str(phase))) {
+			break;
+		}
+	}
+	if (phase == ENERGY_PHASE_COUNT) {
+		shell_error(shell, "Unknown phase: valid are join/sensor/radio/sleep");
+		return -EINVAL;
+	}
+
+	if (argc < 3) {
+		shell_print(shell, "%u uA", lorawan_config.energy_current_uA[phase]);
+	} else {
+		/* Account the time so far with the old figure. */
+		energy_update();
+		lorawan_config.energy_current_uA[phase] = atoi(argv[2]);
+#if IS_ENABLED(CONFIG_SETTINGS)
+		hm_lorawan_nvm_save_settings("energy_current_uA");
+#endif
+	}
+
+	return 0;
+}
+
+static int cmd_energy_capacity(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc < 2) {
+		shell_print(shell, "%u mAh", lorawan_config.battery_capacity_mAh);
+	} else {
+		lorawan_config.battery_capacity_mAh = atoi(argv[1]);
+#if IS_ENABLED(CONFIG_SETTINGS)
+		hm_lorawan_nvm_save_settings("battery_capacity_mAh");
+#endif
+	}
+
+	return 0;
+}
+
+static int cmd_energy_report_interval(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc < 2) {
+		shell_print(shell, "%u uplinks", lorawan_config.energy_report_interval);
+	} else {
+		lorawan_config.energy_report_interval = atoi(argv[1]);
+#if IS_ENABLED(CONFIG_SETTINGS)
+		hm_lorawan_nvm_save_settings("energy_report_interval");
+#endif
+	}
+
+	return 0;
+}
+
+#define HELP_ENERGY_CURRENT "Get/set current of a phase <join|sensor|radio|sleep> [uA]"
+#define HELP_ENERGY_CAPACITY "Get/set battery capacity [mAh]"
+#define HELP_ENERGY_REPORT_INTERVAL "Send energy report every N uplinks, 0 to disable"
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_energy,
+	SHELL_CMD_ARG(current, NULL, HELP_ENERGY_CURRENT, cmd_energy_current, 2, 1),
+	SHELL_CMD_ARG(capacity, NULL, HELP_ENERGY_CAPACITY, cmd_energy_capacity, 1, 1),
+	SHELL_CMD_ARG(report_interval, NULL, HELP_ENERGY_REPORT_INTERVAL,
+		      cmd_energy_report_interval, 1, 1),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(energy, &sub_energy, "Show energy estimate", cmd_energy);
+
 static int cmd_reboot(const struct shell *shell, size_t argc, char **argv)
 {
 	ARG_UNUSED(argc);
 	ARG_UNUSED(argv);
 
 	shell_print(shell, "Reboot...");
+#if IS_ENABLED(CONFIG_SETTINGS)
+	hm_lorawan_nvm_flush();
+#endif
 	sys_reboot(SYS_REBOOT_WARM);
 
 	return 0;
@@ -247,6 +407,10 @@ static int cmd_lorawan_keys(const struct shell *shell, size_t argc, char **argv)
 			shell_lorawan_hexdump(shell, lorawan_config.app_key,
 					sizeof(lorawan_config.app_key), "app_key ");
 		}
+		else if (!strncmp(argv[0], "payload_key", strlen("payload_key"))) {
+			shell_lorawan_hexdump(shell, lorawan_config.payload_key,
+					sizeof(lorawan_config.payload_key), "payload_key ");
+		}
 	} else {
 		if (!strncmp(argv[0], "dev_eui", strlen("dev_eui"))) {
 			len = lorawan_hex2bin(argv[1], strlen(argv[1]), buf, 8);
@@ -278,6 +442,15 @@ static int cmd_lorawan_keys(const struct shell *shell, size_t argc, char **argv)
 			memcpy(lorawan_config.app_key, buf, 16);
 			save = true;
 		}
+		else if (!strncmp(argv[0], "payload_key", strlen("payload_key"))) {
+			len = lorawan_hex2bin(argv[1], strlen(argv[1]), buf, 16);
+			if (len != 16) {
+				LOG_WRN("Not enough or invalid characters, len: %d", len);
+				return -EINVAL;
+			}
+			memcpy(lorawan_config.payload_key, buf, 16);
+			save = true;
+		}
 	}
 
 #if IS_ENABLED(CONFIG_SETTINGS)
@@ -362,12 +535,188 @@ static int cmd_send_interval(const struct shell *shell, size_t argc, char **argv
 	return 0;
 }
 
+static int cmd_inactive_window(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc < 2) {
+		shell_print(shell, "%u sec", lorawan_config.max_inactive_time_window);
+	} else {
+		lorawan_config.max_inactive_time_window = atoi(argv[1]);
+#if IS_ENABLED(CONFIG_SETTINGS)
+		hm_lorawan_nvm_save_settings("max_inactive_time_window");
+#endif
+	}
+
+	return 0;
+}
+
+static int cmd_sample_interval(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc < 2) {
+		shell_print(shell, "%u sec", lorawan_config.sample_interval);
+	} else {
+		lorawan_config.sample_interval = atoi(argv[1]);
+#if IS_ENABLED(CONFIG_SETTINGS)
+		hm_lorawan_nvm_save_settings("sample_interval");
+#endif
+		if (shell_ctx.shell_cb) {
+			shell_ctx.shell_cb(SHELL_CMD_SAMPLE_TIMER, shell_ctx.data);
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_adaptive_send(const struct shell *shell, size_t argc, char **argv)
+{
+	bool save = false;
+
+	if (argc < 2) {
+		shell_print(shell, "%s", lorawan_config.adaptive_send ? "true" : "false");
+	} else {
+		if (!strncmp(argv[1], "true", strlen("true"))) {
+			lorawan_config.adaptive_send = true;
+			save = true;
+		}
+		if (!strncmp(argv[1], "false", strlen("false"))) {
+			lorawan_config.adaptive_send = false;
+			save = true;
+		}
+
+		if (save) {
+#if IS_ENABLED(CONFIG_SETTINGS)
+			hm_lorawan_nvm_save_settings("adaptive_send");
+#endif
+			if (shell_ctx.shell_cb) {
+				shell_ctx.shell_cb(SHELL_CMD_SEND_TIMER, shell_ctx.data);
+			}
+		} else {
+			shell_print(shell, "Invalid input: valid are true/false");
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_payload_encrypt(const struct shell *shell, size_t argc, char **argv)
+{
+	bool save = false;
+
+	if (argc < 2) {
+		shell_print(shell, "%s", lorawan_config.payload_encrypt ? "true" : "false");
+	} else {
+		if (!strncmp(argv[1], "true", strlen("true"))) {
+			if (!IS_ENABLED(CONFIG_TINYCRYPT_AES_CBC)) {
+				shell_error(shell, "Not supported by this build");
+				return -ENOTSUP;
+			}
+			lorawan_config.payload_encrypt = true;
+			save = true;
+		}
+		if (!strncmp(argv[1], "false", strlen("false"))) {
+			lorawan_config.payload_encrypt = false;
+			save = true;
+		}
+
+		if (save) {
+#if IS_ENABLED(CONFIG_SETTINGS)
+			hm_lorawan_nvm_save_settings("payload_encrypt");
+#endif
+		} else {
+			shell_print(shell, "Invalid input: valid are true/false");
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_sensor_profile(const struct shell *shell, size_t argc, char **argv)
+{
+	const struct meteo_profile *profile;
+	int id;
+
+	if (argc < 2) {
+		profile = meteo_profile_get(lorawan_config.sensor_profile);
+		shell_print(shell, "%s", profile->name);
+		return 0;
+	}
+
+	id = meteo_profile_find(argv[1]);
+	if (id < 0) {
+		shell_print(shell, "Invalid input: valid are");
+		for (id = 0; id < METEO_PROFILE_COUNT; id++) {
+			profile = meteo_profile_get(id);
+			shell_print(shell, "  %-16s %u reads", profile->name, profile->reads);
+		}
+		return -EINVAL;
+	}
+
+	lorawan_config.sensor_profile = id;
+#if IS_ENABLED(CONFIG_SETTINGS)
+	hm_lorawan_nvm_save_settings("sensor_profile");
+#endif
+
+	return 0;
+}
+
+static int cmd_adaptive_param(const struct shell *shell, size_t argc, char **argv)
+{
+	if (!strncmp(argv[0], "temp_threshold", strlen("temp_threshold"))) {
+		if (argc < 2) {
+			shell_print(shell, "%u mK", lorawan_config.temp_threshold);
+			return 0;
+		}
+		lorawan_config.temp_threshold = atoi(argv[1]);
+	}
+	else if (!strncmp(argv[0], "press_threshold", strlen("press_threshold"))) {
+		if (argc < 2) {
+			shell_print(shell, "%u Pa", lorawan_config.press_threshold);
+			return 0;
+		}
+		lorawan_config.press_threshold = atoi(argv[1]);
+	}
+	else if (!strncmp(argv[0], "humidity_threshold", strlen("humidity_threshold"))) {
+		if (argc < 2) {
+			shell_print(shell, "%u %%RH", lorawan_config.humidity_threshold);
+			return 0;
+		}
+		lorawan_config.humidity_threshold = atoi(argv[1]);
+	}
+	else if (!strncmp(argv[0], "max_silence_time", strlen("max_silence_time"))) {
+		if (argc < 2) {
+			shell_print(shell, "%u sec", lorawan_config.max_silence_time);
+			return 0;
+		}
+		lorawan_config.max_silence_time = atoi(argv[1]);
+		if (shell_ctx.shell_cb) {
+			shell_ctx.shell_cb(SHELL_CMD_SEND_TIMER, shell_ctx.data);
+		}
+	} else {
+		return -EINVAL;
+	}
+
+#if IS_ENABLED(CONFIG_SETTINGS)
+	hm_lorawan_nvm_save_settings(argv[0]);
+#endif
+
+	return 0;
+}
+
 #define HELP_DEV_EUI "Get/set dev_eui [0011223344556677]"
 #define HELP_APP_EUI "Get/set app_eui [0011223344556677]"
 #define HELP_APP_KEY "get/set app_key [00112233445566778899aabbccddeeff]"
 #define HELP_AUTO_JOIN "Auto join true/false"
 #define HELP_CONFIRMED_MSG "Confirmed messages true/false"
 #define HELP_SEND_INTERVAL "Send interval in seconds"
+#define HELP_INACTIVE_WINDOW "Re-join after not hearing the network that many seconds, 0 never"
+#define HELP_SAMPLE_INTERVAL "Sample interval in seconds, 0 to sample on send"
+#define HELP_ADAPTIVE_SEND "Send only on significant change true/false"
+#define HELP_TEMP_THRESHOLD "Adaptive send temperature threshold in mK"
+#define HELP_PRESS_THRESHOLD "Adaptive send pressure threshold in Pa"
+#define HELP_HUMIDITY_THRESHOLD "Adaptive send humidity threshold in %RH"
+#define HELP_MAX_SILENCE_TIME "Adaptive send max time between uplinks in seconds"
+#define HELP_PAYLOAD_KEY "Get/set payload_key [00112233445566778899aabbccddeeff]"
+#define HELP_PAYLOAD_ENCRYPT "Encrypt data uplinks with payload_key true/false"
+#define HELP_SENSOR_PROFILE "Sensor profile low_power/standard/high_precision"
 
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_lorawan,
 	SHELL_CMD_ARG(dev_eui, NULL, HELP_DEV_EUI, cmd_lorawan_keys, 1, 1),
@@ -376,6 +725,16 @@ SHELL_STATIC_SUBCMD_SET_CREATE(sub_lorawan,
 	SHELL_CMD_ARG(auto_join, NULL, HELP_AUTO_JOIN, cmd_auto_join, 1, 1),
 	SHELL_CMD_ARG(confirmed_msg, NULL, HELP_CONFIRMED_MSG, cmd_confirmed_msg, 1, 1),
 	SHELL_CMD_ARG(send_interval, NULL, HELP_SEND_INTERVAL, cmd_send_interval, 1, 1),
+	SHELL_CMD_ARG(inactive_window, NULL, HELP_INACTIVE_WINDOW, cmd_inactive_window, 1, 1),
+	SHELL_CMD_ARG(sample_interval, NULL, HELP_SAMPLE_INTERVAL, cmd_sample_interval, 1, 1),
+	SHELL_CMD_ARG(adaptive_send, NULL, HELP_ADAPTIVE_SEND, cmd_adaptive_send, 1, 1),
+	SHELL_CMD_ARG(temp_threshold, NULL, HELP_TEMP_THRESHOLD, cmd_adaptive_param, 1, 1),
+	SHELL_CMD_ARG(press_threshold, NULL, HELP_PRESS_THRESHOLD, cmd_adaptive_param, 1, 1),
+	SHELL_CMD_ARG(humidity_threshold, NULL, HELP_HUMIDITY_THRESHOLD, cmd_adaptive_param, 1, 1),
+	SHELL_CMD_ARG(max_silence_time, NULL, HELP_MAX_SILENCE_TIME, cmd_adaptive_param, 1, 1),
+	SHELL_CMD_ARG(payload_key, NULL, HELP_PAYLOAD_KEY, cmd_lorawan_keys, 1, 1),
+	SHELL_CMD_ARG(payload_encrypt, NULL, HELP_PAYLOAD_ENCRYPT, cmd_payload_encrypt, 1, 1),
+	SHELL_CMD_ARG(sensor_profile, NULL, HELP_SENSOR_PROFILE, cmd_sensor_profile, 1, 1),
 	SHELL_SUBCMD_SET_END
 );
 
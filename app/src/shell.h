@@ -9,6 +9,7 @@
 enum shell_cmd_event {
 	SHELL_CMD_SEND_TIMER,
 	SHELL_CMD_SEND_TIMER_GET,
+	SHELL_CMD_SAMPLE_TIMER,
 };
 
 #define DL_SHELL_CMD_BUF_SIZE 64
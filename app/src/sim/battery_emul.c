@@ -0,0 +1,49 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Battery for native_sim. The emulated ADC behind the vbatt voltage
+ * divider sees two alkaline cells which slowly discharge with the
+ * simulated uptime, so the battery monitor reports a changing level.
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/adc/adc_emul.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+
+#define VBATT DT_PATH(vbatt)
+
+#define BATTERY_EMUL_FULL_MV		3100
+#define BATTERY_EMUL_EMPTY_MV		2000
+/* About a year from full to empty */
+#define BATTERY_EMUL_MV_PER_DAY		3
+
+static int battery_emul_value(const struct device *dev, unsigned int chan,
+			      void *user_data, uint32_t *result)
+{
+	int64_t days = k_uptime_get() / (MSEC_PER_SEC * 86400LL);
+	int64_t batt_mV = BATTERY_EMUL_FULL_MV - days * BATTERY_EMUL_MV_PER_DAY;
+
+	ARG_UNUSED(dev);
+	ARG_UNUSED(chan);
+	ARG_UNUSED(user_data);
+
+	batt_mV = MAX(batt_mV, BATTERY_EMUL_EMPTY_MV);
+
+	/* What the ADC sees at the divider output */
+	*result = batt_mV * DT_PROP(VBATT, output_ohms) / DT_PROP(VBATT, full_ohms);
+
+	return 0;
+}
+
+static int battery_emul_init(void)
+{
+	const struct device *adc = DEVICE_DT_GET(DT_IO_CHANNELS_CTLR(VBATT));
+
+	return adc_emul_value_func_set(adc, DT_IO_CHANNELS_INPUT(VBATT),
+				       battery_emul_value, NULL);
+}
+SYS_INIT(battery_emul_init, POST_KERNEL, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,251 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Register level BME280 emulator for native_sim. Each forced mode
+ * conversion reports values from a synthetic weather trace, driven by
+ * the simulated uptime, so the real BME280 driver and its
+ * compensation code are exercised.
+ */
+
+#define DT_DRV_COMPAT bosch_bme280
+
+#include <math.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/i2c_emul.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#define BME280_REG_CALIB00	0x88
+#define BME280_REG_CALIB_H1	0xA1
+#define BME280_REG_ID		0xD0
+#define BME280_REG_CALIB26	0xE1
+#define BME280_REG_CTRL_MEAS	0xF4
+#define BME280_REG_DATA		0xF7
+
+#define BME280_CHIP_ID		0x60
+#define BME280_MODE_MASK	0x03
+#define BME280_MODE_SLEEP	0x00
+
+#define BME280_ADC_MAX		(BIT(20) - 1)
+#define BME280_ADC_H_MAX	(BIT(16) - 1)
+
+/* Typical calibration, from the Bosch datasheet and a real sensor. */
+struct bme280_emul_calib {
+	uint16_t t1;
+	int16_t t2, t3;
+	uint16_t p1;
+	int16_t p2, p3, p4, p5, p6, p7, p8, p9;
+	uint8_t h1;
+	int16_t h2;
+	uint8_t h3;
+	int16_t h4, h5;
+	int8_t h6;
+};
+
+static const struct bme280_emul_calib calib = {
+	.t1 = 27504, .t2 = 26435, .t3 = -1000,
+	.p1 = 36477, .p2 = -10685, .p3 = 3024, .p4 = 2855, .p5 = 140,
+	.p6 = -7, .p7 = 15500, .p8 = -14600, .p9 = 6000,
+	.h1 = 75, .h2 = 362, .h3 = 0, .h4 = 313, .h5 = 50, .h6 = 30,
+};
+
+struct bme280_emul_data {
+	uint8_t regs[256];
+	uint8_t cur_reg;
+};
+
+/* Compensation formulas from the datasheet, as used by the driver. */
+static int32_t comp_temp(int32_t adc_t, int32_t *t_fine)
+{
+	int32_t var1, var2;
+
+	var1 = (((adc_t >> 3) - ((int32_t)calib.t1 << 1)) * calib.t2) >> 11;
+	var2 = (((((adc_t >> 4) - calib.t1) * ((adc_t >> 4) - calib.t1)) >> 12) *
+		calib.t3) >> 14;
+	*t_fine = var1 + var2;
+
+	/* 0.01 Cel */
+	return (*t_fine * 5 + 128) >> 8;
+}
+
+static uint32_t comp_press(int32_t adc_p, int32_t t_fine)
+{
+	int64_t var1, var2, p;
+
+	var1 = (int64_t)t_fine - 128000;
+	var2 = var1 * var1 * calib.p6;
+	var2 = var2 + ((var1 * calib.p5) << 17);
+	var2 = var2 + ((int64_t)calib.p4 << 35);
+	var1 = ((var1 * var1 * calib.p3) >> 8) + ((var1 * calib.p2) << 12);
+	var1 = ((((int64_t)1 << 47) + var1) * calib.p1) >> 33;
+	if (var1 == 0) {
+		return 0;
+	}
+	p = 1048576 - adc_p;
+	p = (((p << 31) - var2) * 3125) / var1;
+	var1 = ((int64_t)calib.p9 * (p >> 13) * (p >> 13)) >> 25;
+	var2 = ((int64_t)calib.p8 * p) >> 19;
+	p = ((p + var1 + var2) >> 8) + ((int64_t)calib.p7 << 4);
+
+	/* Q24.8 Pa */
+	return (uint32_t)p;
+}
+
+static uint32_t comp_humidity(int32_t adc_h, int32_t t_fine)
+{
+	int32_t h;
+
+	h = t_fine - 76800;
+	h = ((((adc_h << 14) - ((int32_t)calib.h4 << 20) - (calib.h5 * h)) + 16384) >> 15) *
+	    (((((((h * calib.h6) >> 10) * (((h * calib.h3) >> 11) + 32768)) >> 10) +
+	       2097152) * calib.h2 + 8192) >> 14);
+	h = h - (((((h >> 15) * (h >> 15)) >> 7) * calib.h1) >> 4);
+	h = CLAMP(h, 0, 419430400);
+
+	/* Q22.10 %RH */
+	return (uint32_t)(h >> 12);
+}
+
+/* Binary search for the raw value which compensates to the target. */
+#define INVERT(_max, _target, _comp_expr, _increasing)				\
+	({									\
+		int32_t lo = 0, hi = (_max);					\
+		while (lo < hi) {						\
+			int32_t adc = lo + (hi - lo) / 2;			\
+			int64_t val = (_comp_expr);				\
+			if ((val < (_target)) == (_increasing)) {		\
+				lo = adc + 1;					\
+			} else {						\
+				hi = adc;					\
+			}							\
+		}								\
+		lo;								\
+	})
+
+static void trace_get(int64_t t_ms, int32_t *temp_centi, uint32_t *press_q8,
+		      uint32_t *hum_q10)
+{
+	double t = t_ms / 1000.0;
+	double day = 2 * M_PI * (t / 86400.0 - 0.375);
+	double temp = 12.0 + 6.0 * sin(day) + 2.0 * sin(2 * M_PI * t / (5 * 86400.0));
+	double press = 101325.0 + 800.0 * sin(2 * M_PI * t / (4 * 86400.0));
+	double hum = 65.0 - 20.0 * sin(day);
+
+	*temp_centi = (int32_t)(temp * 100.0);
+	*press_q8 = (uint32_t)(press * 256.0);
+	*hum_q10 = (uint32_t)(hum * 1024.0);
+}
+
+static void bme280_emul_convert(struct bme280_emul_data *data)
+{
+	int32_t temp_centi, t_fine, adc_t, adc_p, adc_h;
+	uint32_t press_q8, hum_q10;
+	uint8_t *out = &data->regs[BME280_REG_DATA];
+
+	trace_get(k_uptime_get(), &temp_centi, &press_q8, &hum_q10);
+
+	adc_t = INVERT(BME280_ADC_MAX, temp_centi, comp_temp(adc, &t_fine), true);
+	comp_temp(adc_t, &t_fine);
+	adc_p = INVERT(BME280_ADC_MAX, press_q8, comp_press(adc, t_fine), false);
+	adc_h = INVERT(BME280_ADC_H_MAX, hum_q10, comp_humidity(adc, t_fine), true);
+
+	out[0] = adc_p >> 12;
+	out[1] = adc_p >> 4;
+	out[2] = (adc_p & 0xf) << 4;
+	out[3] = adc_t >> 12;
+	out[4] = adc_t >> 4;
+	out[5] = (adc_t & 0xf) << 4;
+	out[6] = adc_h >> 8;
+	out[7] = adc_h;
+}
+
+static void bme280_emul_reg_write(struct bme280_emul_data *data, uint8_t reg, uint8_t val)
+{
+	data->regs[reg] = val;
+
+	if (reg == BME280_REG_CTRL_MEAS && (val & BME280_MODE_MASK) != BME280_MODE_SLEEP) {
+		/* Conversion completes instantly, then back to sleep. */
+		bme280_emul_convert(data);
+		data->regs[reg] &= ~BME280_MODE_MASK;
+	}
+}
+
+static int bme280_emul_transfer(const struct emul *target, struct i2c_msg *msgs,
+				int num_msgs, int addr)
+{
+	struct bme280_emul_data *data = target->data;
+
+	for (int i = 0; i < num_msgs; i++) {
+		struct i2c_msg *msg = &msgs[i];
+
+		if (msg->flags & I2C_MSG_READ) {
+			/* Burst read from the current register. */
+			for (uint32_t j = 0; j < msg->len; j++) {
+				msg->buf[j] = data->regs[data->cur_reg++];
+			}
+		} else if (msg->len > 0) {
+			/* Register address, optionally followed by reg/value pairs. */
+			data->cur_reg = msg->buf[0];
+			if (msg->len > 1) {
+				bme280_emul_reg_write(data, msg->buf[0], msg->buf[1]);
+			}
+			for (uint32_t j = 2; j + 1 < msg->len; j += 2) {
+				bme280_emul_reg_write(data, msg->buf[j], msg->buf[j + 1]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static const struct i2c_emul_api bme280_emul_api = {
+	.transfer = bme280_emul_transfer,
+};
+
+static int bme280_emul_init(const struct emul *target, const struct device *parent)
+{
+	struct bme280_emul_data *data = target->data;
+	uint8_t *c = &data->regs[BME280_REG_CALIB00];
+	uint8_t *h = &data->regs[BME280_REG_CALIB26];
+
+	ARG_UNUSED(parent);
+
+	data->regs[BME280_REG_ID] = BME280_CHIP_ID;
+
+	sys_put_le16(calib.t1, &c[0]);
+	sys_put_le16(calib.t2, &c[2]);
+	sys_put_le16(calib.t3, &c[4]);
+	sys_put_le16(calib.p1, &c[6]);
+	sys_put_le16(calib.p2, &c[8]);
+	sys_put_le16(calib.p3, &c[10]);
+	sys_put_le16(calib.p4, &c[12]);
+	sys_put_le16(calib.p5, &c[14]);
+	sys_put_le16(calib.p6, &c[16]);
+	sys_put_le16(calib.p7, &c[18]);
+	sys_put_le16(calib.p8, &c[20]);
+	sys_put_le16(calib.p9, &c[22]);
+
+	data->regs[BME280_REG_CALIB_H1] = calib.h1;
+	sys_put_le16(calib.h2, &h[0]);
+	h[2] = calib.h3;
+	h[3] = calib.h4 >> 4;
+	h[4] = (calib.h4 & 0xf) | ((calib.h5 & 0xf) << 4);
+	h[5] = calib.h5 >> 4;
+	h[6] = calib.h6;
+
+	bme280_emul_convert(data);
+
+	return 0;
+}
+
+#define BME280_EMUL(n)								\
+	static struct bme280_emul_data bme280_emul_data_##n;			\
+	EMUL_DT_INST_DEFINE(n, bme280_emul_init, &bme280_emul_data_##n, NULL,	\
+			    &bme280_emul_api, NULL)
+
+DT_INST_FOREACH_STATUS_OKAY(BME280_EMUL)
@@ -0,0 +1,261 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Loopback LoRaWAN backend for native_sim, used instead of the real
+ * stack when CONFIG_LORAWAN is disabled. Joins always succeed, and
+ * uplinks are appended to a CSV file on the host together with their
+ * estimated time on air, rather than being transmitted. Confirmed
+ * uplinks, link checks and time requests always get an answer. The
+ * network clock runs slightly faster than the simulated one. The calls
+ * block for as long as the radio would be busy on real hardware, so
+ * the energy accounting stays meaningful. As with the real stack,
+ * pending MAC commands take room from the payload, and a payload which
+ * does not fit is dropped for an empty frame, with -EAGAIN.
+ */
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/lorawan/lorawan.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/sys/util.h>
+
+#include "cmdline.h"
+#include "posix_native_task.h"
+#include "uplink_log.h"
+
+#define LOG_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(helium_meteo_lorawan_loopback);
+
+/* EU868 timings */
+#define LOOPBACK_JOIN_ACCEPT_DELAY_MS 5000
+#define LOOPBACK_RX_WINDOWS_MS 2000
+#define LOOPBACK_PREAMBLE_SYMBOLS 8
+/* MHDR, FHDR without FOpts, FPort and MIC */
+#define LOOPBACK_MAC_OVERHEAD 13
+/* LinkCheckReq and DeviceTimeReq, in FOpts */
+#define LOOPBACK_MAC_COMMAND_SIZE 1
+
+#define LOOPBACK_LINE_MAX_SIZE (64 + 2 * 242)
+
+/* Link check answer of a comfortable link */
+#define LOOPBACK_LINK_MARGIN_DB 20
+#define LOOPBACK_LINK_GATEWAYS 1
+#define LOOPBACK_LINK_RSSI -90
+#define LOOPBACK_LINK_SNR 5
+
+/* GPS time at boot, 2026-01-01, and the drift of the device clock */
+#define LOOPBACK_GPS_TIME_BASE_S 1451260818LL
+#define LOOPBACK_CLOCK_DRIFT_PPM 20
+
+/* Maximum application payload per data rate, EU868 */
+static const uint8_t loopback_max_payload[] = { 51, 51, 51, 115, 242, 242, 242, 242 };
+
+static const char *loopback_log_path = "uplinks.csv";
+static enum lorawan_datarate loopback_dr = LORAWAN_DR_0;
+static void (*loopback_dr_cb)(enum lorawan_datarate dr);
+static lorawan_link_check_ans_cb_t loopback_link_check_cb;
+static struct lorawan_downlink_cb *loopback_downlink_cb;
+static bool loopback_link_check;
+static bool loopback_device_time;
+static bool loopback_joined;
+static uint32_t loopback_fcnt;
+
+static void loopback_options(void)
+{
+	static struct args_struct_t loopback_opts[] = {
+		{
+			.option = "uplink-log",
+			.name = "path",
+			.type = 's',
+			.dest = (void *)&loopback_log_path,
+			.descript = "CSV file to which the loopback LoRaWAN uplinks are "
+				    "appended. Defaults to uplinks.csv",
+		},
+		ARG_TABLE_ENDMARKER
+	};
+
+	native_add_command_line_opts(loopback_opts);
+}
+
+NATIVE_TASK(loopback_options, PRE_BOOT_1, 1);
+
+/*
+ * Time on air from the Semtech SX127x datasheet, for 125 kHz LoRa with
+ * explicit header, CRC and 4/5 coding rate. DR6 and DR7 are
+ * approximated as DR5.
+ */
+static uint32_t loopback_airtime_ms(enum lorawan_datarate dr, uint8_t len)
+{
+	int sf = 12 - MIN(dr, LORAWAN_DR_5);
+	int de = (sf >= 11) ? 1 : 0;
+	int bits = 8 * (len + LOOPBACK_MAC_OVERHEAD) - 4 * sf + 28 + 16;
+	int payload_sym = 8 + DIV_ROUND_UP(MAX(bits, 0), 4 * (sf - 2 * de)) * 5;
+	/* 2^SF / 125 kHz */
+	uint32_t sym_us = BIT(sf) * 8;
+
+	return ((LOOPBACK_PREAMBLE_SYMBOLS * 4 + 17) * sym_us / 4 +
+		payload_sym * sym_us) / USEC_PER_MSEC;
+}
+
+int lorawan_start(void)
+{
+	if (hm_sim_uplink_log_open(loopback_log_path)) {
+		return -EIO;
+	}
+
+	LOG_INF("Loopback LoRaWAN, uplinks logged to %s", loopback_log_path);
+
+	return 0;
+}
+
+int lorawan_join(const struct lorawan_join_config *config)
+{
+	ARG_UNUSED(config);
+
+	k_sleep(K_MSEC(loopback_airtime_ms(loopback_dr, 0) + LOOPBACK_JOIN_ACCEPT_DELAY_MS));
+
+	loopback_joined = true;
+	loopback_fcnt = 0;
+
+	if (loopback_dr_cb) {
+		loopback_dr_cb(loopback_dr);
+	}
+
+	return 0;
+}
+
+int lorawan_set_datarate(enum lorawan_datarate dr)
+{
+	if (dr >= ARRAY_SIZE(loopback_max_payload)) {
+		return -EINVAL;
+	}
+
+	loopback_dr = dr;
+
+	return 0;
+}
+
+/* Room left by the MAC commands pending for the next uplink. */
+static uint8_t loopback_max_next_payload(void)
+{
+	return loopback_max_payload[loopback_dr] -
+	       (loopback_link_check + loopback_device_time) * LOOPBACK_MAC_COMMAND_SIZE;
+}
+
+void lorawan_get_payload_sizes(uint8_t *max_next_payload_size, uint8_t *max_payload_size)
+{
+	*max_next_payload_size = loopback_max_next_payload();
+	*max_payload_size = loopback_max_payload[loopback_dr];
+}
+
+void lorawan_register_downlink_callback(struct lorawan_downlink_cb *cb)
+{
+	/* Only for the MAC answers, there are no application downlinks. */
+	loopback_downlink_cb = cb;
+}
+
+void lorawan_register_dr_changed_callback(void (*dr_cb)(enum lorawan_datarate))
+{
+	loopback_dr_cb = dr_cb;
+}
+
+void lorawan_register_link_check_ans_callback(lorawan_link_check_ans_cb_t cb)
+{
+	loopback_link_check_cb = cb;
+}
+
+int lorawan_request_link_check(bool force_request)
+{
+	if (!loopback_joined) {
+		return -ENOTCONN;
+	}
+
+	/* Answered after the next uplink. */
+	loopback_link_check = true;
+	if (force_request) {
+		return lorawan_send(0, NULL, 0, LORAWAN_MSG_UNCONFIRMED);
+	}
+
+	return 0;
+}
+
+int lorawan_request_device_time(bool force_request)
+{
+	if (!loopback_joined) {
+		return -ENOTCONN;
+	}
+
+	/* Answered after the next uplink. */
+	loopback_device_time = true;
+	if (force_request) {
+		return lorawan_send(0, NULL, 0, LORAWAN_MSG_UNCONFIRMED);
+	}
+
+	return 0;
+}
+
+int lorawan_device_time_get(uint32_t *gps_time)
+{
+	int64_t uptime_ms = k_uptime_get();
+
+	*gps_time = LOOPBACK_GPS_TIME_BASE_S +
+		    (uptime_ms + uptime_ms * LOOPBACK_CLOCK_DRIFT_PPM / 1000000) / MSEC_PER_SEC;
+
+	return 0;
+}
+
+int lorawan_send(uint8_t port, uint8_t *data, uint8_t len, enum lorawan_message_type type)
+{
+	char line[LOOPBACK_LINE_MAX_SIZE];
+	uint32_t airtime_ms;
+	bool empty_frame = false;
+	int n;
+
+	if (!loopback_joined) {
+		return -ENOTCONN;
+	}
+
+	if (len > loopback_max_next_payload()) {
+		/* The real stack flushes the MAC commands instead. */
+		LOG_ERR("Payload of %u bytes does not fit, sending an empty frame", len);
+		empty_frame = true;
+		port = 0;
+		len = 0;
+		type = LORAWAN_MSG_UNCONFIRMED;
+	}
+
+	airtime_ms = loopback_airtime_ms(loopback_dr, len);
+
+	n = snprintk(line, sizeof(line), "%lld,%u,%u,%d,%d,%u,%u,",
+		     (long long)k_uptime_get(), loopback_fcnt++, port,
+		     type == LORAWAN_MSG_CONFIRMED, loopback_dr, len, airtime_ms);
+	for (int i = 0; i < len; i++) {
+		n += snprintk(&line[n], sizeof(line) - n, "%02x", data[i]);
+	}
+	snprintk(&line[n], sizeof(line) - n, "\n");
+	hm_sim_uplink_log_write(line);
+
+	k_sleep(K_MSEC(airtime_ms + LOOPBACK_RX_WINDOWS_MS));
+
+	if (loopback_link_check) {
+		loopback_link_check = false;
+		if (loopback_link_check_cb) {
+			loopback_link_check_cb(LOOPBACK_LINK_MARGIN_DB, LOOPBACK_LINK_GATEWAYS,
+					       LOOPBACK_LINK_RSSI, LOOPBACK_LINK_SNR);
+		}
+	}
+
+	if (loopback_device_time) {
+		loopback_device_time = false;
+		if (loopback_downlink_cb) {
+			loopback_downlink_cb->cb(0, LORAWAN_TIME_UPDATED, LOOPBACK_LINK_RSSI,
+						 LOOPBACK_LINK_SNR, 0, NULL);
+		}
+	}
+
+	return empty_frame ? -EAGAIN : 0;
+}
@@ -0,0 +1,18 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __HELIUM_METEO_SIM_UPLINK_LOG_H__
+#define __HELIUM_METEO_SIM_UPLINK_LOG_H__
+
+/*
+ * Host side of the native_sim loopback LoRaWAN backend. These are
+ * built against the host C library, so that the uplink log can be
+ * written to a regular file.
+ */
+int hm_sim_uplink_log_open(const char *path);
+
+void hm_sim_uplink_log_write(const char *line);
+
+#endif /* __HELIUM_METEO_SIM_UPLINK_LOG_H__ */
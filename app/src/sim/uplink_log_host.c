@@ -0,0 +1,39 @@
+/*
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+
+#include "uplink_log.h"
+
+#define UPLINK_LOG_HEADER "uptime_ms,fcnt,port,confirmed,dr,len,airtime_ms,payload\n"
+
+static FILE *uplink_log;
+
+int hm_sim_uplink_log_open(const char *path)
+{
+	uplink_log = fopen(path, "a");
+	if (uplink_log == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	fseek(uplink_log, 0, SEEK_END);
+	if (ftell(uplink_log) == 0) {
+		fputs(UPLINK_LOG_HEADER, uplink_log);
+	}
+
+	return 0;
+}
+
+void hm_sim_uplink_log_write(const char *line)
+{
+	if (uplink_log == NULL) {
+		return;
+	}
+
+	fputs(line, uplink_log);
+	/* The simulation may be stopped at any time with --stop_at. */
+	fflush(uplink_log);
+}
@@ -0,0 +1,224 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Move measurements older than a cutoff out of the database, into
+# compressed columnar archive files, one per device and month. Also
+# reads them back, for plot.py and dump.py.
+# Usage::
+#    ./archive.py <cutoff>
+#
+# The cutoff is a local time, e.g. 2024-01-01. Rollups are kept in the
+# database, so long range plots still cover the archived time.
+
+import os
+import sys
+import mmap
+import zlib
+import array
+import bisect
+import struct
+import sqlite3
+import datetime
+import itertools
+import urllib.parse
+
+ARCHIVE_DIR = 'archive'
+ARCHIVE_MAGIC = b'HMA1'
+
+# Columns, with the array type code and the scale of their integers.
+# Times are stored as deltas from the previous row.
+ARCHIVE_COLUMNS = (('measured_at_ms', 'q', 1),
+                   ('temperature', 'i', 1000),
+                   ('pressure', 'i', 100),
+                   ('humidity', 'i', 1000),
+                   ('battery_voltage', 'i', 1000))
+
+# Magic, number of rows, and the compressed size of each column.
+# The compressed columns follow, in order.
+ARCHIVE_HEADER = struct.Struct('<4sI' + 'I' * len(ARCHIVE_COLUMNS))
+
+# File holding the given device's measurements of the given month.
+def archive_path(archive_dir, name, month):
+    return os.path.join(archive_dir, urllib.parse.quote(name, safe=''), month + '.hma')
+
+# UTC month of a time in ms, as YYYY-MM.
+def month_of(ms):
+    return datetime.datetime.fromtimestamp(ms / 1000, datetime.timezone.utc).strftime('%Y-%m')
+
+# A single archive file, memory mapped. Columns are only
+# decompressed when asked for.
+class ArchiveFile():
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, self.count, *sizes = ARCHIVE_HEADER.unpack_from(self.map)
+        if magic != ARCHIVE_MAGIC:
+            raise ValueError(f'{path}: not an archive file')
+        self.columns = {}
+        pos = ARCHIVE_HEADER.size
+        for (name, typecode, scale), size in zip(ARCHIVE_COLUMNS, sizes):
+            self.columns[name] = (pos, size, typecode, scale)
+            pos += size
+
+    # Values of a column, as the stored integers if scaled is False.
+    def column(self, name, scaled=True):
+        pos, size, typecode, scale = self.columns[name]
+        vals = array.array(typecode)
+        with memoryview(self.map) as view:
+            vals.frombytes(zlib.decompress(view[pos:pos + size]))
+        if sys.byteorder != 'little':
+            vals.byteswap()
+        if name == 'measured_at_ms':
+            return list(itertools.accumulate(vals))
+        if not scaled:
+            return vals
+        return [v / scale for v in vals]
+
+    # Rows as tuples in ARCHIVE_COLUMNS order, with start_ms <= time <= end_ms.
+    def rows(self, start_ms=0, end_ms=sys.maxsize, scaled=True):
+        times = self.column('measured_at_ms')
+        lo = bisect.bisect_left(times, start_ms)
+        hi = bisect.bisect_right(times, end_ms)
+        if lo >= hi:
+            return []
+        cols = [times] + [self.column(name, scaled) for name, _, _ in ARCHIVE_COLUMNS[1:]]
+        rows = zip(*(col[lo:hi] for col in cols))
+        if not scaled:
+            return list(rows)
+        # A battery voltage of 0 means it is not known.
+        return [row[:4] + (row[4] or None,) for row in rows]
+
+    def close(self):
+        self.map.close()
+
+# Row of measurement values as the integers they are stored as.
+def scale_row(row):
+    return tuple(round((val or 0) * scale) for val, (_, _, scale) in zip(row, ARCHIVE_COLUMNS))
+
+# Write rows of stored integers, see scale_row().
+def write_archive_file(path, rows):
+    rows = sorted(rows)
+    blobs = []
+    for i, (name, typecode, scale) in enumerate(ARCHIVE_COLUMNS):
+        vals = [row[i] for row in rows]
+        if name == 'measured_at_ms':
+            vals = [t - prev for t, prev in zip(vals, [0] + vals[:-1])]
+        vals = array.array(typecode, vals)
+        if sys.byteorder != 'little':
+            vals.byteswap()
+        blobs.append(zlib.compress(vals.tobytes(), 9))
+
+    # Replace the file only once the new one is complete.
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    tmp_path = path + '.tmp'
+    with open(tmp_path, 'wb') as f:
+        f.write(ARCHIVE_HEADER.pack(ARCHIVE_MAGIC, len(rows), *(len(b) for b in blobs)))
+        for blob in blobs:
+            f.write(blob)
+        f.flush()
+        os.fsync(f.fileno())
+    os.replace(tmp_path, path)
+
+# Rows of the given device, or all devices if name is None, as
+# (name, row) tuples ordered by time within each device.
+def read_archive(archive_dir, name=None, start_ms=0, end_ms=sys.maxsize):
+    if not os.path.isdir(archive_dir):
+        return
+    if name is None:
+        names = sorted(urllib.parse.unquote(d) for d in os.listdir(archive_dir))
+    else:
+        names = [name]
+    first_month, last_month = month_of(start_ms), month_of(min(end_ms, 253402300799000))
+    for dev in names:
+        dev_dir = os.path.dirname(archive_path(archive_dir, dev, 'x'))
+        if not os.path.isdir(dev_dir):
+            continue
+        for file_name in sorted(os.listdir(dev_dir)):
+            month, ext = os.path.splitext(file_name)
+            if ext != '.hma' or month < first_month or month > last_month:
+                continue
+            archive = ArchiveFile(os.path.join(dev_dir, file_name))
+            for row in archive.rows(start_ms, end_ms):
+                yield dev, row
+            archive.close()
+
+# Make the archived measurements of the given device (or of all devices)
+# and local time range visible to queries on this connection, through
+# the temporary all_measurements view. It has the same rows as
+#   measurements INNER JOIN reports ON reports.id = measurements.report_id
+# plus the archived ones, with columns name_id, measured_at_ms,
+# temperature, pressure, humidity, battery_voltage and reported_at_ms.
+# Archived measurements have no report, their reported_at_ms is their
+# measured_at_ms.
+def attach(conn, name=None, start=None, end=None, archive_dir=ARCHIVE_DIR):
+    conn.execute('CREATE TEMP TABLE IF NOT EXISTS archived_measurements('
+                    'name_id INTEGER,'
+                    'measured_at_ms UNSIGNED BIGINT,'
+                    'temperature REAL,'
+                    'pressure REAL,'
+                    'humidity REAL,'
+                    'battery_voltage REAL)')
+    conn.execute('CREATE TEMP VIEW IF NOT EXISTS all_measurements AS '
+                 'SELECT reports.name_id AS name_id, measurements.measured_at_ms AS measured_at_ms, '
+                        'measurements.temperature AS temperature, measurements.pressure AS pressure, '
+                        'measurements.humidity AS humidity, reports.battery_voltage AS battery_voltage, '
+                        'reports.reported_at_ms AS reported_at_ms '
+                 'FROM measurements INNER JOIN reports ON reports.id = measurements.report_id '
+                 'UNION ALL SELECT *, measured_at_ms FROM temp.archived_measurements')
+    conn.execute('DELETE FROM temp.archived_measurements')
+
+    start_ms, end_ms = conn.execute("SELECT COALESCE(strftime('%s', ?, 'utc') * 1000, 0), "
+                                    "COALESCE(strftime('%s', ?, 'utc') * 1000, 9223372036854775807)",
+                                    (start, end)).fetchone()
+    name_ids = dict(conn.execute('SELECT name, id FROM device_names'))
+    conn.executemany('INSERT INTO temp.archived_measurements VALUES (?, ?, ?, ?, ?, ?)',
+                     ((name_ids.get(dev),) + row
+                      for dev, row in read_archive(archive_dir, name, start_ms, end_ms)))
+
+# Move the measurements older than cutoff_ms into the archive. Reports
+# left without measurements are dropped with their hotspot connections.
+def archive(conn, cutoff_ms, archive_dir=ARCHIVE_DIR):
+    groups = {}
+    rows = conn.execute('SELECT device_names.name, measurements.measured_at_ms, measurements.temperature, '
+                               'measurements.pressure, measurements.humidity, reports.battery_voltage '
+                        'FROM ((measurements '
+                        'INNER JOIN reports ON reports.id = measurements.report_id) '
+                        'INNER JOIN device_names ON device_names.id = reports.name_id) '
+                        'WHERE measurements.measured_at_ms < ?', (cutoff_ms,))
+    for name, *row in rows:
+        groups.setdefault((name, month_of(row[0])), []).append(scale_row(row))
+
+    for (name, month), rows in groups.items():
+        path = archive_path(archive_dir, name, month)
+        if os.path.exists(path):
+            # Merge with an earlier run. Rows from a run which was
+            # interrupted before deleting them are only kept once.
+            old = ArchiveFile(path)
+            rows = set(rows).union(old.rows(scaled=False))
+            old.close()
+        write_archive_file(path, rows)
+        print(f'{path}: {len(rows)} measurements')
+
+    with conn:
+        conn.execute('DELETE FROM measurements WHERE measured_at_ms < ?', (cutoff_ms,))
+        orphans = ('SELECT id FROM reports WHERE reported_at_ms < ? '
+                   'AND NOT EXISTS (SELECT 1 FROM measurements WHERE measurements.report_id = reports.id) '
+                   'AND NOT EXISTS (SELECT 1 FROM energy_reports WHERE energy_reports.report_id = reports.id)')
+        conn.execute('DELETE FROM hotspot_connections WHERE report_id IN (' + orphans + ')', (cutoff_ms,))
+        conn.execute('DELETE FROM reports WHERE id IN (' + orphans + ')', (cutoff_ms,))
+
+    return sum(len(rows) for rows in groups.values())
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print("Usage: ./archive.py cutoff")
+        exit(1)
+
+    conn = sqlite3.connect("meteo.db")
+    cutoff_ms = conn.execute("SELECT strftime('%s', ?, 'utc') * 1000", (sys.argv[1],)).fetchone()[0]
+    if cutoff_ms is None:
+        print(f'Invalid cutoff time {sys.argv[1]}')
+        exit(1)
+    count = archive(conn, cutoff_ms)
+    print(f'Archived {count} measurements. Run "sqlite3 meteo.db VACUUM" to shrink the database file.')
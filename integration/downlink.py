@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Remote configuration of devices by downlink, see app/src/downlink.h.
+# Commands are queued in the database. The server hands them to the LNS
+# when the device sends its next uplink, so that they go out in one of
+# the following receive windows. Usage::
+#    ./downlink.py <dev_eui> <setting>=<value> [<setting>=<value> ...]
+#    ./downlink.py --list
+#
+# The LNS is the ChirpStack REST API at LNS_API_URL, with the API token
+# from LNS_API_TOKEN_FILE.
+
+import os
+import sys
+import json
+import time
+import queue
+import base64
+import sqlite3
+import threading
+import urllib.request
+
+DOWNLINK_CONFIG_PORT = 4
+# Largest downlink at EU868 DR0
+DOWNLINK_MAX_SIZE = 51
+
+# Setting types and their ranges. Keep in sync with app/src/downlink.c.
+DOWNLINK_SETTINGS = {
+    'send_interval':      (0x01, 60, 7 * 24 * 3600),
+    'sample_interval':    (0x02, 0, 24 * 3600),
+    'adaptive_send':      (0x03, 0, 1),
+    'temp_threshold':     (0x04, 0, 100000),
+    'press_threshold':    (0x05, 0, 100000),
+    'humidity_threshold': (0x06, 0, 100),
+    'max_silence_time':   (0x07, 60, 7 * 24 * 3600),
+    'data_rate':          (0x08, 0, 7),
+    'confirmed_msg':      (0x09, 0, 1),
+}
+DOWNLINK_NAMES = {type: name for name, (type, _, _) in DOWNLINK_SETTINGS.items()}
+
+LNS_API_URL = os.environ.get('LNS_API_URL', 'http://localhost:8090')
+LNS_API_TOKEN_FILE = 'lns_api_token.txt'
+LNS_API_TIMEOUT_S = 10
+
+# Seconds between checks for newly queued commands.
+DOWNLINK_REFRESH_S = 10.0
+DOWNLINK_UPLINK_QUEUE_SIZE = 1000
+
+# Settings as TLVs, with values as short as they can be.
+def encode(settings):
+    data = b''
+    for name, val in settings.items():
+        if name not in DOWNLINK_SETTINGS:
+            raise ValueError(f'Unknown setting {name}')
+        type, lo, hi = DOWNLINK_SETTINGS[name]
+        if val < lo or val > hi:
+            raise ValueError(f'{name} must be within {lo}..{hi}')
+        size = max((val.bit_length() + 7) // 8, 1)
+        data += bytes((type, size)) + val.to_bytes(size, 'little')
+    return data
+
+def decode(data):
+    settings = {}
+    pos = 0
+    while pos < len(data):
+        if len(data) - pos < 2 or data[pos + 1] < 1 or data[pos + 1] > 4 or len(data) - pos - 2 < data[pos + 1]:
+            raise ValueError('Truncated setting')
+        type, size = data[pos], data[pos + 1]
+        if type not in DOWNLINK_NAMES:
+            raise ValueError(f'Unknown setting type {type:#x}')
+        settings[DOWNLINK_NAMES[type]] = int.from_bytes(data[pos + 2:pos + 2 + size], 'little')
+        pos += 2 + size
+    return settings
+
+def enqueue(conn, dev_eui, settings):
+    data = encode(settings)
+    if len(data) > DOWNLINK_MAX_SIZE:
+        raise ValueError(f'Too many settings for one downlink ({len(data)} bytes)')
+    with conn:
+        conn.execute('INSERT INTO downlink_queue (dev_eui, data, created_at_ms) VALUES (?, ?, ?)',
+                     (dev_eui.lower(), data, int(time.time() * 1000)))
+
+# Hand the pending commands of a device to the LNS, as one downlink.
+# Later commands override earlier ones for the same setting. Commands
+# which do not fit wait for the next uplink.
+def send_pending(conn, dev_eui, post):
+    rows = conn.execute('SELECT id, data FROM downlink_queue '
+                        'WHERE dev_eui = ? AND sent_at_ms IS NULL ORDER BY id', (dev_eui,)).fetchall()
+    settings = {}
+    ids = []
+    for id, data in rows:
+        merged = dict(settings, **decode(data))
+        if ids and len(encode(merged)) > DOWNLINK_MAX_SIZE:
+            break
+        settings = merged
+        ids.append(id)
+    if not ids:
+        return 0
+    post(dev_eui, encode(settings))
+    with conn:
+        conn.executemany('UPDATE downlink_queue SET sent_at_ms = ? WHERE id = ?',
+                         ((int(time.time() * 1000), id) for id in ids))
+    return len(ids)
+
+# Enqueue a downlink with the ChirpStack REST API.
+def lns_post(dev_eui, data):
+    with open(LNS_API_TOKEN_FILE) as f:
+        token = f.readline().strip()
+    body = {'queueItem': {'confirmed': False, 'fPort': DOWNLINK_CONFIG_PORT,
+                          'data': base64.b64encode(data).decode('ascii')}}
+    req = urllib.request.Request(f'{LNS_API_URL}/api/devices/{dev_eui}/queue',
+                                 data=json.dumps(body).encode('utf-8'), method='POST',
+                                 headers={'Content-Type': 'application/json',
+                                          'Grpc-Metadata-Authorization': f'Bearer {token}'})
+    with urllib.request.urlopen(req, timeout=LNS_API_TIMEOUT_S):
+        pass
+
+# Sends the queued commands of devices as their uplinks come in. Runs
+# on its own thread, so that a slow LNS does not hold up the server.
+class DownlinkSender(threading.Thread):
+    def __init__(self, db_path='meteo.db', post=lns_post):
+        threading.Thread.__init__(self, daemon=True)
+        self.db_path = db_path
+        self.post = post
+        self.uplinks = queue.Queue(maxsize=DOWNLINK_UPLINK_QUEUE_SIZE)
+        self.sent = 0
+
+    # Called for each uplink. Never blocks.
+    def uplink(self, dev_eui):
+        try:
+            self.uplinks.put_nowait(dev_eui.lower())
+        except queue.Full:
+            pass
+
+    def stop(self):
+        self.uplinks.put(None)
+        self.join()
+
+    def run(self):
+        conn = sqlite3.connect(self.db_path)
+        pending = set()
+        refreshed_at = None
+        while True:
+            try:
+                dev_eui = self.uplinks.get(timeout=DOWNLINK_REFRESH_S)
+            except queue.Empty:
+                dev_eui = ''
+            if dev_eui is None:
+                break
+            # Commands are queued by other processes, so look for new
+            # ones now and then rather than query on every uplink. A
+            # database without the queue yet, e.g. one made before it
+            # was added, or a locked one is tried again next time.
+            if refreshed_at is None or time.monotonic() - refreshed_at >= DOWNLINK_REFRESH_S:
+                refreshed_at = time.monotonic()
+                try:
+                    pending = set(row[0] for row in conn.execute(
+                        'SELECT DISTINCT dev_eui FROM downlink_queue WHERE sent_at_ms IS NULL'))
+                except sqlite3.Error as e:
+                    print(f'Checking for queued downlinks failed: {e}')
+            if dev_eui not in pending:
+                continue
+            try:
+                self.sent += send_pending(conn, dev_eui, self.post)
+                pending.discard(dev_eui)
+            except Exception as e:
+                print(f'Downlink to {dev_eui} failed: {e}')
+        conn.close()
+
+if __name__ == '__main__':
+    conn = sqlite3.connect('meteo.db')
+    if len(sys.argv) == 2 and sys.argv[1] == '--list':
+        for row in conn.execute('SELECT dev_eui, data, created_at_ms, sent_at_ms FROM downlink_queue ORDER BY id'):
+            dev_eui, data, created_at_ms, sent_at_ms = row
+            state = 'pending' if sent_at_ms is None else 'sent'
+            print(f'{dev_eui} {state}: ' + ' '.join(f'{k}={v}' for k, v in decode(data).items()))
+        exit(0)
+    if len(sys.argv) < 3:
+        print('Usage: ./downlink.py dev_eui setting=value [setting=value ...]')
+        print('       ./downlink.py --list')
+        print('Settings: ' + ', '.join(DOWNLINK_SETTINGS))
+        exit(1)
+    try:
+        settings = {}
+        for arg in sys.argv[2:]:
+            name, val = arg.split('=', 1)
+            settings[name] = int(val, 0)
+        enqueue(conn, sys.argv[1], settings)
+    except ValueError as e:
+        print(e)
+        exit(1)
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Print the output of queries/dump-data.sql, together with the
+# measurements moved to the archive by archive.py.
+# Usage::
+#    ./dump.py [name [start [end]]]
+#
+# Start and end are local times, e.g. 2024-01-01. Archived measurements
+# have no report details, so those columns are left empty. Untimed
+# samples have no time, so they are only listed without a time range.
+
+import os
+import sys
+import time
+import heapq
+import sqlite3
+import archive
+
+def dump(name=None, start=None, end=None):
+    conn = sqlite3.connect("meteo.db")
+    with open(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'queries', 'dump-data.sql')) as f:
+        sql = f.read()
+    live = conn.execute(sql, {'device': name, 'start': start, 'end': end})
+
+    start_ms, end_ms = conn.execute("SELECT COALESCE(strftime('%s', ?, 'utc') * 1000, 0), "
+                                    "COALESCE(strftime('%s', ?, 'utc') * 1000, 9223372036854775807)",
+                                    (start, end)).fetchone()
+    archived = ((time.strftime('%Y-%m-%d %H:%M:%S', time.localtime(row[0] / 1000)),
+                 None, None, None, dev, row[4], row[1], row[2], row[3])
+                for dev, row in archive.read_archive(archive.ARCHIVE_DIR, name, start_ms, end_ms))
+
+    # Both are ordered by time, at least per device. Untimed samples
+    # come first, as SQLite sorts them.
+    for row in heapq.merge(sorted(archived, key=lambda row: row[0]), live, key=lambda row: row[0] or ''):
+        print('|'.join('' if val is None else str(val) for val in row))
+
+if __name__ == '__main__':
+    if len(sys.argv) > 4:
+        print("Usage: ./dump.py [name [start [end]]]")
+        exit(1)
+    dump(*sys.argv[1:])
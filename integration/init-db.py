@@ -6,14 +6,117 @@
 #   - SQL INT can store entire EUI (64-bits).
 import sqlite3
 
+# Downsampled rollup tables and their period. Keep in sync with meteo.py.
+ROLLUP_PERIODS = (('rollup_hourly', 3600 * 1000), ('rollup_daily', 24 * 3600 * 1000))
+ROLLUP_FIELDS = ('temperature', 'pressure', 'humidity', 'battery_voltage')
+
 def get_db_cursor():
     con = sqlite3.connect("meteo.db")
     cur = con.cursor()
     return cur
 
 
+# Bring a database created by an older version of this script up to date.
+def upgrade(cur):
+    columns = [row[1] for row in cur.execute('PRAGMA table_info(measurements)')]
+    if 'measured_at_ms' not in columns:
+        cur.execute('ALTER TABLE measurements ADD COLUMN measured_at_ms UNSIGNED BIGINT')
+        # Samples used to store no time of their own when it was the
+        # same as the report time. Now NULL means an untimed sample.
+        cur.execute('UPDATE measurements SET measured_at_ms = '
+                        '(SELECT reported_at_ms FROM reports WHERE reports.id = measurements.report_id) '
+                    'WHERE measured_at_ms IS NULL')
+    columns = [row[1] for row in cur.execute('PRAGMA table_info(reports)')]
+    if 'power_profile' not in columns:
+        cur.execute('ALTER TABLE reports ADD COLUMN power_profile INTEGER')
+    create_energy_reports(cur)
+    create_name_indexes(cur)
+    create_indexes(cur)
+    create_rollups(cur)
+    create_downlink_queue(cur)
+    # Refresh the statistics the query planner picks indexes by.
+    cur.execute('ANALYZE')
+    cur.connection.commit()
+
+
+# Energy accounting reports, one row per phase.
+def create_energy_reports(cur):
+    cur.execute('CREATE TABLE IF NOT EXISTS energy_reports('
+                    'id INTEGER PRIMARY KEY AUTOINCREMENT,'
+                    'report_id INTEGER NOT NULL,'
+                    'phase VARCHAR(16),'
+                    'time_s INTEGER,'
+                    'charge_uAh INTEGER,'
+                    'FOREIGN KEY(report_id) REFERENCES reports(id))')
+
+
+# Commands waiting to be sent to devices, see downlink.py.
+def create_downlink_queue(cur):
+    cur.execute('CREATE TABLE IF NOT EXISTS downlink_queue('
+                    'id INTEGER PRIMARY KEY AUTOINCREMENT,'
+                    'dev_eui VARCHAR(16) NOT NULL,'
+                    'data BLOB,'
+                    'created_at_ms UNSIGNED BIGINT,'
+                    'sent_at_ms UNSIGNED BIGINT)')
+    cur.execute('CREATE INDEX IF NOT EXISTS downlink_queue_pending ON downlink_queue(dev_eui, sent_at_ms)')
+
+
+# Names are looked up on every uplink, so index them. A database
+# written by an older version might hold duplicate names, in which
+# case fall back to a plain index.
+def create_name_indexes(cur):
+    for table in ('dev_eui', 'dev_addr', 'device_names', 'profile_names', 'hotspot_names'):
+        try:
+            cur.execute(f'CREATE UNIQUE INDEX IF NOT EXISTS {table}_name ON {table}(name)')
+        except sqlite3.IntegrityError:
+            print(f'Warning: duplicate names in {table}, the index on it is not unique')
+            cur.execute(f'CREATE INDEX IF NOT EXISTS {table}_name ON {table}(name)')
+
+
+# Indexes for selecting measurements by time and device, and
+# for joining reports to their measurements and hotspots.
+def create_indexes(cur):
+    cur.execute('CREATE INDEX IF NOT EXISTS measurements_time ON measurements(measured_at_ms, report_id)')
+    cur.execute('CREATE INDEX IF NOT EXISTS measurements_report ON measurements(report_id)')
+    cur.execute('CREATE INDEX IF NOT EXISTS reports_device_time ON reports(name_id, reported_at_ms)')
+    cur.execute('CREATE INDEX IF NOT EXISTS reports_time ON reports(reported_at_ms)')
+    cur.execute('CREATE INDEX IF NOT EXISTS hotspot_connections_report ON hotspot_connections(report_id)')
+
+
+# Per device min/max/sum/count of each field, per period. Times are
+# the UTC start of each period. Rollups are maintained by meteo.py on
+# ingest. Empty ones are filled from the measurements, so a rollup can
+# be rebuilt by dropping its table and running this script again.
+def create_rollups(cur):
+    for table, period_ms in ROLLUP_PERIODS:
+        cur.execute(f'CREATE TABLE IF NOT EXISTS {table}('
+                        'name_id INTEGER NOT NULL,'
+                        'bucket_ms UNSIGNED BIGINT NOT NULL,'
+                        'count INTEGER,' +
+                        ''.join(f'{f}_min REAL, {f}_max REAL, {f}_sum REAL,' for f in ROLLUP_FIELDS) +
+                        'PRIMARY KEY(name_id, bucket_ms),'
+                        'FOREIGN KEY(name_id) REFERENCES device_names(id))')
+        if cur.execute(f'SELECT 1 FROM {table} LIMIT 1').fetchone() is not None:
+            continue
+        # Battery voltage is only kept per report.
+        cols = {'temperature': 'measurements.temperature',
+                'pressure': 'measurements.pressure',
+                'humidity': 'measurements.humidity',
+                'battery_voltage': 'reports.battery_voltage'}
+        cur.execute(f'INSERT INTO {table} '
+                    f'SELECT reports.name_id, measurements.measured_at_ms / {period_ms} * {period_ms}, COUNT(*), ' +
+                    ', '.join(f'MIN({cols[f]}), MAX({cols[f]}), SUM({cols[f]})' for f in ROLLUP_FIELDS) +
+                    ' FROM measurements INNER JOIN reports ON reports.id = measurements.report_id'
+                    ' WHERE measurements.measured_at_ms IS NOT NULL'
+                    ' GROUP BY 1, 2')
+
+
 def main():
     cur = get_db_cursor()
+    cur.execute("SELECT name FROM sqlite_master WHERE type = 'table' AND name = 'reports'")
+    if cur.fetchone() is not None:
+        upgrade(cur)
+        return
     # Battery voltage is really part of the payload, and not part of the Integration
     # JSON record. But I consider this an implementation detail.
     # The logical place for battery voltage is in the overall report, rather
@@ -28,6 +131,7 @@ def main():
                     'name_id INTEGER,'
                     'profile_id INTEGER,'
                     'battery_voltage REAL,'
+                    'power_profile INTEGER,'
                     'reported_at_ms UNSIGNED BIGINT,'
                     'FOREIGN KEY(dev_eui_id) REFERENCES dev_eui(id),'
                     'FOREIGN KEY(dev_addr_id) REFERENCES dev_addr(id),'
@@ -59,6 +163,7 @@ def main():
                     'temperature REAL,'
                     'pressure REAL,'
                     'humidity REAL,'
+                    'measured_at_ms UNSIGNED BIGINT,'
                     'FOREIGN KEY(report_id) REFERENCES reports(id))')
     # Store EUI as strings because SQLite3 Python
     # binding cannot handle 64-bit Python integers,
@@ -69,6 +174,12 @@ def main():
     cur.execute('CREATE TABLE dev_addr('
                     'id INTEGER PRIMARY KEY AUTOINCREMENT,'
                     'name VARCHAR(16))')
+    create_energy_reports(cur)
+    create_name_indexes(cur)
+    create_indexes(cur)
+    create_rollups(cur)
+    create_downlink_queue(cur)
+    cur.connection.commit()
 
 if __name__ == '__main__':
     main()
@@ -9,100 +9,580 @@
 
 # Assumptions:
 #   - SQL INT can store entire EUI (64-bits).
+import os
 import sys
 import sqlite3
+import collections
 import base64
 import json
 import struct
 import binascii
 import datetime
+import time
+import itertools
+import gc
+import threading
 
 from Cryptodome.Cipher import AES
 
-# Decoded payload from the device.
-class Payload():
+# Legacy record layout: struct s_meteo_data on the device.
+LEGACY_RECORD = struct.Struct('<iibh')
+
+# Compact format ids, see app/src/payload.h.
+PAYLOAD_FMT_V2 = 0x20
+PAYLOAD_FMT_V3 = 0x30
+PAYLOAD_FMT_MASK = 0xf0
+PAYLOAD_FLAG_AGE = 0x01
+PAYLOAD_FLAG_POWER = 0x02
+PAYLOAD_FLAG_TIME = 0x04
+PAYLOAD_FLAG_UNTIMED = 0x08
+# Seconds from the Unix to the GPS epoch, less the leap seconds since.
+GPS_UNIX_OFFSET_S = 315964800 - 18
+# Battery-aware power profiles, see app/src/power_governor.h.
+POWER_PROFILES = ('normal', 'saver', 'critical')
+
+# Diagnostic uplinks, see app/src/energy.h.
+DIAG_PORT = 3
+ENERGY_REPORT_FMT_V1 = 0x01
+ENERGY_PHASES = ('join', 'sensor', 'radio', 'sleep')
+
+# Uplinks are written to the database in batches, one transaction per
+# batch, instead of committing after every row. A batch is written once
+# it is full, or once its oldest uplink has waited for too long.
+INGEST_BATCH_SIZE = 500
+INGEST_BATCH_DELAY_S = 1.0
+
+# Tables mapping names to ids, and the number
+# of entries of each kept in memory.
+NAME_TABLES = ('dev_eui', 'dev_addr', 'device_names', 'profile_names', 'hotspot_names')
+NAME_CACHE_SIZE = 10000
+
+# Downsampled rollup tables and their period, see init-db.py.
+ROLLUP_PERIODS = (('rollup_hourly', 3600 * 1000), ('rollup_daily', 24 * 3600 * 1000))
+ROLLUP_FIELDS = ('temperature', 'pressure', 'humidity', 'battery_voltage')
+
+# Number of uplinks decoded and inserted at once by Meteo.replay().
+REPLAY_CHUNK_SIZE = 20000
+
+# Keys of encrypted payloads, see app/src/payload_crypt.h. Devices
+# listed in PAYLOAD_KEYS_FILE, one "<dev_eui> <key>" per line, encrypt
+# all their data uplinks. The single key in PAYLOAD_DEFAULT_KEY_FILE is
+# tried on the 32 byte payloads of the other devices. To create a key
+# use either one of the following commands:
+#  $ dd if=/dev/random bs=16 count=1 | xxd -p
+#  $ openssl rand -hex 16
+PAYLOAD_KEYS_FILE = 'payload_keys.txt'
+PAYLOAD_DEFAULT_KEY_FILE = 'payload_aes_key.hex'
+# Seconds between checks of the key files for changes.
+PAYLOAD_KEYS_CHECK_S = 5.0
+
+# Helpers for the varint encoding used by the compact format.
+# Both return the decoded value and the position after it.
+def read_uvarint(buf, pos):
+    val = 0
+    shift = 0
+    while True:
+        if pos >= len(buf) or shift > 28:
+            raise ValueError('Truncated varint')
+        b = buf[pos]
+        pos += 1
+        val |= (b & 0x7f) << shift
+        shift += 7
+        if not b & 0x80:
+            return val, pos
+
+def read_svarint(buf, pos):
+    val, pos = read_uvarint(buf, pos)
+    return (val >> 1) ^ -(val & 1), pos
+
+# Header of a compact payload. Returns whether it is V3, the flags,
+# the sample count, the power profile and the position of the body.
+def read_compact_header(payload_bin):
+    if len(payload_bin) < 2 or (payload_bin[0] & PAYLOAD_FMT_MASK) not in (PAYLOAD_FMT_V2, PAYLOAD_FMT_V3):
+        raise ValueError('Not a compact payload')
+    v3 = (payload_bin[0] & PAYLOAD_FMT_MASK) == PAYLOAD_FMT_V3
+    flags = payload_bin[0] & ~PAYLOAD_FMT_MASK
+    if flags & ~(PAYLOAD_FLAG_AGE | PAYLOAD_FLAG_POWER | PAYLOAD_FLAG_TIME | PAYLOAD_FLAG_UNTIMED):
+        raise ValueError(f'Unknown compact payload flags {flags:#x}')
+    count = payload_bin[1]
+    if count == 0:
+        raise ValueError('Empty compact payload')
+    if not flags & PAYLOAD_FLAG_POWER:
+        return v3, flags, count, 0, 2
+    if len(payload_bin) < 3:
+        raise ValueError('Truncated compact payload header')
+    return v3, flags, count, payload_bin[2], 3
+
+# Temperature, pressure, humidity and battery voltage of the decoded
+# compact values. V3 has signed 0.01 Cel and 0.01 %RH, V2 unsigned mK
+# and whole %RH. Works on NumPy arrays of values too.
+def compact_units(v3, temperature, pressure, humidity, battery):
+    if v3:
+        return temperature / 100.0, pressure, humidity / 100.0, battery / 1000.0
+    return temperature / 1000.0 - 273.15, pressure, humidity, battery / 1000.0
+
+# Name of a power profile id, or the id itself if it is unknown.
+def power_profile_name(profile):
+    return POWER_PROFILES[profile] if profile < len(POWER_PROFILES) else str(profile)
+
+# A single measurement taken by the device.
+class Sample():
     def __init__(self):
         self.temperature = 0.0
         self.pressure_Pa = 0.0
         self.humidity_RH = 0.0
         self.battery_voltage = 0.0
+        # Seconds between taking the sample and sending it,
+        # or None if the payload does not tell.
+        self.age_s = None
+        # Unix time of the sample by the network synced device
+        # clock, or None if the payload does not tell.
+        self.time_s = None
+        # Logged before a reboot of the device, so its time is unknown.
+        self.untimed = False
+
+    # Time of the sample in ms, for an uplink received at reported_at_ms,
+    # or None if it is unknown.
+    def measured_at_ms(self, reported_at_ms):
+        if self.untimed:
+            return None
+        if self.time_s is not None:
+            return self.time_s * 1000
+        if self.age_s is not None:
+            return reported_at_ms - self.age_s * 1000
+        return reported_at_ms
+
+# AES-128 decryption of payloads with one key. CBC is done here on top
+# of ECB, so that a single cipher object serves all payloads, instead of
+# setting up a new one for every IV.
+class PayloadCipher():
+    def __init__(self, key):
+        self.ecb = AES.new(key, AES.MODE_ECB)
+
+    # An IV followed by the CBC ciphertext of the PKCS#7 padded payload.
+    def decrypt(self, enc):
+        if len(enc) < 2 * AES.block_size or len(enc) % AES.block_size:
+            raise ValueError(f'Invalid encrypted payload length {len(enc)}')
+        plain = self.ecb.decrypt(enc[AES.block_size:])
+        # Each block is XORed with the previous ciphertext block, the IV for the first one.
+        plain = (int.from_bytes(plain, 'big') ^
+                 int.from_bytes(enc[:-AES.block_size], 'big')).to_bytes(len(plain), 'big')
+        pad = plain[-1]
+        if pad < 1 or pad > AES.block_size or plain[-pad:] != bytes([pad]) * pad:
+            raise ValueError('Invalid encrypted payload padding, wrong key?')
+        return plain[:-pad]
+
+# Payload keys by dev_eui, loaded from the key files, and loaded again
+# when they change. Safe to use from several threads.
+class PayloadKeys():
+    def __init__(self, keys_path=PAYLOAD_KEYS_FILE, default_key_path=PAYLOAD_DEFAULT_KEY_FILE):
+        self.paths = (keys_path, default_key_path)
+        self.lock = threading.Lock()
+        self.checked_at = None
+        self.stamps = None
+        # Ciphers by key, kept across reloads.
+        self.cipher_cache = {}
+        self.ciphers = {}
+        self.check()
+
+    def file_stamps(self):
+        stamps = []
+        for path in self.paths:
+            try:
+                st = os.stat(path)
+                stamps.append((st.st_mtime_ns, st.st_size))
+            except FileNotFoundError:
+                stamps.append(None)
+        return stamps
+
+    def cipher(self, key_hex):
+        key = binascii.unhexlify(key_hex)
+        if key not in self.cipher_cache:
+            self.cipher_cache[key] = PayloadCipher(key)
+        return self.cipher_cache[key]
+
+    def load(self):
+        keys_path, default_key_path = self.paths
+        ciphers = {}
+        if os.path.exists(default_key_path):
+            with open(default_key_path) as f:
+                try:
+                    ciphers[None] = self.cipher(f.readline().strip())
+                except ValueError as e:
+                    print(f'{default_key_path}: {e}')
+        if os.path.exists(keys_path):
+            with open(keys_path) as f:
+                for line_no, line in enumerate(f, 1):
+                    line = line.split('#')[0].strip()
+                    if not line:
+                        continue
+                    try:
+                        dev_eui, key_hex = line.split()
+                        ciphers[dev_eui.lower()] = self.cipher(key_hex)
+                    except ValueError as e:
+                        print(f'{keys_path}:{line_no}: {e}')
+        self.cipher_cache = {key: cipher for key, cipher in self.cipher_cache.items()
+                             if cipher in ciphers.values()}
+        return ciphers
+
+    # Reload the keys if the files changed. The files are only looked
+    # at every PAYLOAD_KEYS_CHECK_S seconds.
+    def check(self):
+        with self.lock:
+            now = time.monotonic()
+            if self.checked_at is not None and now - self.checked_at < PAYLOAD_KEYS_CHECK_S:
+                return
+            self.checked_at = now
+            stamps = self.file_stamps()
+            if stamps != self.stamps:
+                self.stamps = stamps
+                self.ciphers = self.load()
+
+    # Cipher of the given device, or the default one if dev_eui is None.
+    def get(self, dev_eui):
+        self.check()
+        return self.ciphers.get(dev_eui.lower() if dev_eui is not None else None)
+
+# Decoded payload from the device. One uplink may
+# carry several samples, ordered oldest first.
+class Payload():
+    def __init__(self):
+        self.samples = []
+        # Power profile the device runs in, see POWER_PROFILES.
+        self.power_profile = 0
+
+    # Payloads are decrypted with the PayloadKeys given, if any.
+    def decode(self, base64_str, keys=None, dev_eui=None):
+        self.samples, legacy_bin = self.decode_compact(base64.b64decode(base64_str), keys, dev_eui)
+        if legacy_bin is not None:
+            self.samples = self.decode_legacy(legacy_bin)
+
+    # Decode the formats other than plain legacy records. Returns
+    # (samples, None), or (None, legacy records left to decode).
+    def decode_compact(self, payload_bin, keys=None, dev_eui=None):
+        cipher = keys.get(dev_eui) if keys is not None and dev_eui is not None else None
+        if cipher is not None:
+            payload_bin = cipher.decrypt(payload_bin)
+        # Legacy payloads carry no format id, so a legacy record could
+        # happen to start with one. Only accept the compact format if
+        # the whole payload parses.
+        try:
+            return self.decode_varint(payload_bin), None
+        except ValueError:
+            pass
+        if cipher is None and keys is not None and len(payload_bin) == (AES.block_size + AES.key_size[0]):
+            cipher = keys.get(None)
+            if cipher is not None:
+                return self.decode_compact(cipher.decrypt(payload_bin))
+        return None, payload_bin
+
+    # One or more back-to-back struct s_meteo_data records.
+    def decode_legacy(self, payload_bin):
+        if len(payload_bin) == 0 or len(payload_bin) % LEGACY_RECORD.size:
+            raise ValueError(f'Invalid payload length {len(payload_bin)}')
+        samples = []
+        for payload_raw in LEGACY_RECORD.iter_unpack(payload_bin):
+            sample = Sample()
+            sample.temperature = payload_raw[0] / 1000.0 - 273.15
+            sample.pressure_Pa = payload_raw[1]
+            sample.humidity_RH = payload_raw[2]
+            sample.battery_voltage = payload_raw[3] / 1000.0
+            samples.append(sample)
+        return samples
+
+    # Base sample followed by zigzag varint deltas, see
+    # read_compact_header() and compact_units().
+    def decode_varint(self, payload_bin):
+        v3, flags, count, power_profile, pos = read_compact_header(payload_bin)
+        vals = [0, 0, 0, 0]
+        ages = []
+        samples = []
+        for i in range(count):
+            if flags & PAYLOAD_FLAG_AGE:
+                age, pos = read_uvarint(payload_bin, pos)
+                ages.append(age)
+            for f in range(len(vals)):
+                if i == 0 and not (v3 and f == 0):
+                    vals[f], pos = read_uvarint(payload_bin, pos)
+                elif i == 0:
+                    vals[f], pos = read_svarint(payload_bin, pos)
+                else:
+                    delta, pos = read_svarint(payload_bin, pos)
+                    vals[f] += delta
+            sample = Sample()
+            (sample.temperature, sample.pressure_Pa,
+             sample.humidity_RH, sample.battery_voltage) = compact_units(v3, *vals)
+            samples.append(sample)
+        if pos != len(payload_bin):
+            raise ValueError('Trailing bytes in compact payload')
+        # The oldest sample carries its age, or its GPS time with
+        # PAYLOAD_FLAG_TIME, the rest carry the interval since the
+        # previous sample.
+        if ages and flags & PAYLOAD_FLAG_TIME:
+            time_s = ages[0] + GPS_UNIX_OFFSET_S
+            for i, sample in enumerate(samples):
+                if i > 0:
+                    time_s += ages[i]
+                sample.time_s = time_s
+        elif ages:
+            age = ages[0]
+            for i, sample in enumerate(samples):
+                if i > 0:
+                    age = max(age - ages[i], 0)
+                sample.age_s = age
+        elif flags & PAYLOAD_FLAG_UNTIMED:
+            for sample in samples:
+                sample.untimed = True
+        self.power_profile = power_profile
+        return samples
+
+# Decode many compact payloads at once, for the bulk replay. Payloads
+# with the same format, flags and sample count are decoded together,
+# one column of varints at a time. Returns, per payload, the power
+# profile, the measured_at_ms and the [temperature, pressure, humidity,
+# battery_voltage] of each sample, as Sample.measured_at_ms() and
+# Payload.decode_varint() give them. The header and the units are
+# those of decode_varint(), through read_compact_header() and
+# compact_units(). Payloads which do not parse give None, and are left
+# to Payload.decode_compact().
+def decode_compact_batch(payload_bins, reported_at_ms):
+    import numpy
+
+    results = [None] * len(payload_bins)
+    heads = []
+    bodies = []
+    for i, payload_bin in enumerate(payload_bins):
+        try:
+            v3, flags, count, power_profile, pos = read_compact_header(payload_bin)
+        except ValueError:
+            continue
+        # The body must end a varint.
+        if len(payload_bin) <= pos or payload_bin[-1] & 0x80:
+            continue
+        heads.append((i, (v3, flags & ~PAYLOAD_FLAG_POWER), count, power_profile))
+        bodies.append(payload_bin[pos:])
+    if not bodies:
+        return results
+
+    # The bodies are nothing but varints, and each ends one, so they
+    # can be split into varints all together. A byte without the
+    # continuation bit ends a varint.
+    data = numpy.frombuffer(b''.join(bodies), dtype=numpy.uint8)
+    lengths = numpy.array([len(body) for body in bodies])
+    body_starts = numpy.cumsum(lengths) - lengths
+    ends = data < 0x80
+    starts = numpy.flatnonzero(numpy.r_[True, ends[:-1]])
+    shifts = numpy.arange(len(data)) - starts[numpy.cumsum(ends) - ends]
+    values = numpy.add.reduceat((data & 0x7f).astype(numpy.int64) << (7 * numpy.minimum(shifts, 4)), starts)
+    # Varints per body, the index of the first one, and whether
+    # one is longer than read_uvarint() accepts.
+    counts = numpy.add.reduceat(ends.astype(numpy.int64), body_starts)
+    firsts = numpy.cumsum(counts) - counts
+    too_long = numpy.add.reduceat(shifts > 4, body_starts) > 0
+
+    groups = collections.defaultdict(list)
+    for body, (i, kind, count, power_profile) in enumerate(heads):
+        groups[(kind, count)].append(body)
+    for ((v3, flags), count), members in groups.items():
+        fields = 5 if flags & PAYLOAD_FLAG_AGE else 4
+        members = numpy.array(members)
+        members = members[(counts[members] == count * fields) & ~too_long[members]]
+        if not len(members):
+            continue
+        cols = values[firsts[members][:, None] + numpy.arange(count * fields)]
+        cols = cols.reshape(len(members), count, fields)
+
+        # The first sample, but for the v3 temperature, is unsigned,
+        # the deltas to it are zigzag coded.
+        vals = cols[:, :, fields - 4:]
+        zigzag = (vals >> 1) ^ -(vals & 1)
+        vals = numpy.concatenate((vals[:, :1], zigzag[:, 1:]), axis=1)
+        if v3:
+            vals[:, 0, 0] = zigzag[:, 0, 0]
+        vals = numpy.cumsum(vals, axis=1)
+        rows = numpy.stack(compact_units(v3, *numpy.moveaxis(vals, -1, 0)), axis=-1).tolist()
+
+        reported = numpy.array([reported_at_ms[heads[body][0]] for body in members], dtype=numpy.int64)
+        if flags & PAYLOAD_FLAG_AGE and flags & PAYLOAD_FLAG_TIME:
+            times = ((numpy.cumsum(cols[:, :, 0], axis=1) + GPS_UNIX_OFFSET_S) * 1000).tolist()
+        elif flags & PAYLOAD_FLAG_AGE:
+            passed = numpy.cumsum(cols[:, :, 0], axis=1) - cols[:, :1, 0]
+            ages = numpy.maximum(cols[:, :1, 0] - passed, 0)
+            times = (reported[:, None] - ages * 1000).tolist()
+        elif flags & PAYLOAD_FLAG_UNTIMED:
+            times = [[None] * count] * len(members)
+        else:
+            times = numpy.repeat(reported[:, None], count, axis=1).tolist()
+        for body, sample_times, sample_rows in zip(members.tolist(), times, rows):
+            i, _, _, power_profile = heads[body]
+            results[i] = (power_profile, sample_times, sample_rows)
+
+    return results
+
+# Decoded energy accounting report from the device.
+class EnergyReport():
+    def __init__(self):
+        self.time_s = {}
+        self.charge_uAh = {}
 
     def decode(self, base64_str):
         payload_bin = base64.b64decode(base64_str)
-        if len(payload_bin) == (AES.block_size + AES.key_size[0]):
-            payload_bin = self.decrypt(payload_bin)
-        payload_raw = struct.unpack('<iibh', payload_bin)
-        self.temperature = payload_raw[0] / 1000.0 - 273.15
-        self.pressure_Pa = payload_raw[1]
-        self.humidity_RH = payload_raw[2]
-        self.battery_voltage = payload_raw[3] / 1000.0
+        if len(payload_bin) < 1 or payload_bin[0] != ENERGY_REPORT_FMT_V1:
+            raise ValueError('Unknown energy report format')
+        pos = 1
+        for phase in ENERGY_PHASES:
+            self.time_s[phase], pos = read_uvarint(payload_bin, pos)
+        for phase in ENERGY_PHASES:
+            self.charge_uAh[phase], pos = read_uvarint(payload_bin, pos)
+        if pos != len(payload_bin):
+            raise ValueError('Trailing bytes in energy report')
 
-    def decrypt(self, enc):
-        # To create a key use either one of the following commands: 
-        #  $ dd if=/dev/random bs=16 count=1 | xxd -p > payload_aes_key.hex
-        #  $ openssl rand -hex 16 > payload_aes_key.hex
-        with open('payload_aes_key.hex') as f:
-            key = binascii.unhexlify(f.readline().strip())
-        iv = enc[:AES.block_size]
-        cipher = AES.new(key, AES.MODE_CBC, iv)
-        return cipher.decrypt(enc[AES.block_size:])
+# Bounded cache of name to id mappings, dropping the least recently used.
+class NameCache():
+    def __init__(self, size):
+        self.size = size
+        self.ids = collections.OrderedDict()
+
+    def get(self, name):
+        id = self.ids.get(name)
+        if id is not None:
+            self.ids.move_to_end(name)
+        return id
+
+    def put(self, name, id):
+        self.ids[name] = id
+        self.ids.move_to_end(name)
+        if len(self.ids) > self.size:
+            self.ids.popitem(last=False)
+
+    def clear(self):
+        self.ids.clear()
+
+# A decoded uplink, waiting to be written to the database.
+# Encrypted payloads are decrypted with the PayloadKeys given.
+class Uplink():
+    def __init__(self, json_str, keys=None):
+        self.received_at = time.monotonic()
+        self.rec = json.loads(json_str)
+        self.epoch_timestamp_ms = int(datetime.datetime.fromisoformat(self.rec['time']).timestamp() * 1000)
+        self.energy = None
+        self.samples = []
+        self.power_profile = None
+
+        if int(self.rec['fPort']) == DIAG_PORT:
+            self.energy = EnergyReport()
+            self.energy.decode(self.rec['data'])
+        else:
+            payload = Payload()
+            payload.decode(self.rec['data'], keys, self.rec['deviceInfo']['devEui'])
+            self.samples = payload.samples
+            self.power_profile = payload.power_profile
+
+    def print(self):
+        if self.energy is not None:
+            for phase in ENERGY_PHASES:
+                print(f'{phase}: {self.energy.time_s[phase]}s, {self.energy.charge_uAh[phase]}uAh')
+        if self.power_profile:
+            print(f'Power profile: {power_profile_name(self.power_profile)}')
+        for sample in self.samples:
+            print(f'T={sample.temperature}°C, P={sample.pressure_Pa/100}hPa, RH={sample.humidity_RH}%, BAT={sample.battery_voltage}mV')
 
 # Main class for parsing and handling JSON data from the Helium integration
 # POST request.
 #
 # Reference: https://docs.helium.com/use-the-network/console/integrations/json-schema/
 class Meteo():
-    def __init__(self):
-        self.conn = sqlite3.connect("meteo.db")
+    # Constant SQL strings, so that sqlite3 can reuse the prepared
+    # statements from its cache.
+    SQL_INSERT_HOTSPOT = 'INSERT INTO hotspot_connections (report_id, frequency, name_id, rssi, snr) VALUES (?, ?, ?, ?, ?)'
+    SQL_INSERT_REPORT = 'INSERT INTO reports (dev_eui_id, dev_addr_id, dc_balance, fcnt, port, name_id, profile_id, battery_voltage, power_profile, reported_at_ms) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)'
+    SQL_INSERT_MEASUREMENT = 'INSERT INTO measurements (report_id, temperature, pressure, humidity, measured_at_ms) VALUES (?, ?, ?, ?, ?)'
+    SQL_INSERT_ENERGY = 'INSERT INTO energy_reports (report_id, phase, time_s, charge_uAh) VALUES (?, ?, ?, ?)'
+    SQL_UPSERT_ROLLUP = {table: f'INSERT INTO {table} (name_id, bucket_ms, count, ' +
+                                ', '.join(f'{f}_min, {f}_max, {f}_sum' for f in ROLLUP_FIELDS) +
+                                ') VALUES (?, ?, ?' + ', ?, ?, ?' * len(ROLLUP_FIELDS) + ') '
+                                'ON CONFLICT(name_id, bucket_ms) DO UPDATE SET count = count + excluded.count, ' +
+                                ', '.join(f'{f}_min = MIN({f}_min, excluded.{f}_min), '
+                                          f'{f}_max = MAX({f}_max, excluded.{f}_max), '
+                                          f'{f}_sum = {f}_sum + excluded.{f}_sum' for f in ROLLUP_FIELDS)
+                         for table, period_ms in ROLLUP_PERIODS}
+
+    def __init__(self, db_path='meteo.db'):
+        self.conn = sqlite3.connect(db_path)
+        # With WAL, readers do not block the writer, and with
+        # synchronous=NORMAL commits do not wait for an fsync.
+        # A power loss may lose the last transactions, but
+        # does not corrupt the database.
+        self.conn.execute('PRAGMA journal_mode=WAL')
+        self.conn.execute('PRAGMA synchronous=NORMAL')
+        self.pending = []
+        self.pending_since = None
+        self.name_caches = {table: NameCache(NAME_CACHE_SIZE) for table in NAME_TABLES}
+        self.warm_name_caches()
+        self.keys = PayloadKeys()
+
+    # Preload the most recently added names.
+    def warm_name_caches(self):
+        for table, cache in self.name_caches.items():
+            cache.clear()
+            sel = 'SELECT name, id FROM ' + table + ' ORDER BY id DESC LIMIT ?'
+            rows = self.conn.execute(sel, (cache.size,)).fetchall()
+            for name, id in reversed(rows):
+                cache.put(name, id)
 
     # Generic method to acquire an ID from a given
     # strings table.  If the name does not exist,
     # it will create the necessary row, so that
     # a valid ID is always returned.
     def get_id_from_string(self, table, name_str):
+        cache = self.name_caches[table]
+        id = cache.get(name_str)
+        if id is not None:
+            return id
         cur = self.conn.cursor()
         sel = 'SELECT id FROM ' + table + ' WHERE name = ?'
         cur.execute(sel, (name_str,))
         result = cur.fetchone()
         if result is not None:
-            return result[0]
+            id = result[0]
         else:
             sql = 'INSERT INTO ' + table + ' (name) VALUES (?)'
             vals = (name_str,)
             cur.execute(sql, vals)
-            self.conn.commit()
-            return cur.lastrowid
+            id = cur.lastrowid
+        cache.put(name_str, id)
+        return id
 
     def get_hotspot_id(self, name_str, lat, lng):
+        cache = self.name_caches['hotspot_names']
+        id = cache.get(name_str)
+        if id is not None:
+            return id
         cur = self.conn.cursor()
         sel = 'SELECT id FROM hotspot_names WHERE name = ?'
         cur.execute(sel, (name_str,))
         result = cur.fetchone()
         if result is not None:
-            return result[0]
+            id = result[0]
         else:
             sql = 'INSERT INTO hotspot_names (name, lat, lng) VALUES (?, ?, ?)'
             vals = (name_str, lat, lng)
             cur.execute(sql, vals)
-            self.conn.commit()
-            return cur.lastrowid
+            id = cur.lastrowid
+        cache.put(name_str, id)
+        return id
 
     # Insert an entry into the hotspot connections table.
     def record_hotspot(self, report_id, rec, frequency_hZ):
-        sql = 'INSERT INTO hotspot_connections (report_id, frequency, name_id, rssi, snr) VALUES (?, ?, ?, ?, ?)'
         vals = (report_id,
                 int(frequency_hZ),
                 self.get_hotspot_id(rec['metadata']['gateway_name'], float(rec['metadata']['gateway_lat']), float(rec['metadata']['gateway_long'])),
                 float(rec['rssi']),
                 float(rec['snr'] if 'snr' in rec else -1000000))
-        cur = self.conn.cursor()
-        cur.execute(sql, vals)
-        self.conn.commit()
+        self.conn.execute(self.SQL_INSERT_HOTSPOT, vals)
 
     # Insert a new report entry.
-    def record_report(self, rec, battery_voltage):
-        sql = 'INSERT INTO reports (dev_eui_id, dev_addr_id, dc_balance, fcnt, port, name_id, profile_id, battery_voltage, reported_at_ms) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)'
-        epoch_timestamp_ms = datetime.datetime.fromisoformat(rec['time']).timestamp() * 1000
+    def record_report(self, rec, battery_voltage, power_profile, epoch_timestamp_ms):
         vals = (self.get_id_from_string('dev_eui', rec['deviceInfo']['devEui']),
                 self.get_id_from_string('dev_addr', rec['devAddr']),
                 int(rec['dc']['balance'] if 'dc' in rec else -1),
@@ -111,44 +591,307 @@ class Meteo():
                 self.get_id_from_string('device_names', rec['deviceInfo']['deviceName']),
                 self.get_id_from_string('profile_names', rec['deviceInfo']['deviceProfileName']),
                 battery_voltage,
+                power_profile,
                 int(epoch_timestamp_ms))
-        cur = self.conn.cursor()
-        cur.execute(sql, vals)
-        self.conn.commit()
-        report_id =  cur.lastrowid
-
-        return report_id
+        cur = self.conn.execute(self.SQL_INSERT_REPORT, vals)
+        return cur.lastrowid
 
     # Insert a new meteo measurement.
-    def record_measurement(self, report_id, payload):
-        sql = 'INSERT INTO measurements (report_id, temperature, pressure, humidity) VALUES (?, ?, ?, ?)'
+    def record_measurement(self, report_id, sample, measured_at_ms):
         vals = (report_id,
-                payload.temperature,
-                payload.pressure_Pa,
-                payload.humidity_RH)
-        cur = self.conn.cursor()
-        cur.execute(sql, vals)
-        self.conn.commit()
+                sample.temperature,
+                sample.pressure_Pa,
+                sample.humidity_RH,
+                measured_at_ms)
+        self.conn.execute(self.SQL_INSERT_MEASUREMENT, vals)
 
-    # Parse the given JSON string and then insert the
-    # data into rows of the respective tables.
-    def record(self, json_str):
-        rec = json.loads(json_str)
+    # Add the samples of a device to the hourly and daily rollups.
+    # Battery voltage is kept per report, so the samples of a report
+    # all count with its battery voltage, as when rebuilding them from
+    # the database.
+    def record_rollups(self, name_id, samples, battery_voltage):
+        for table, period_ms in ROLLUP_PERIODS:
+            rows = []
+            for measured_at_ms, sample in samples:
+                vals = (sample.temperature, sample.pressure_Pa, sample.humidity_RH, battery_voltage)
+                row = [name_id, measured_at_ms // period_ms * period_ms, 1]
+                for val in vals:
+                    row += [val, val, val]
+                rows.append(row)
+            self.conn.executemany(self.SQL_UPSERT_ROLLUP[table], rows)
 
-        payload = Payload()
-        payload.decode(rec['data'])
-        print(f'T={payload.temperature}°C, P={payload.pressure_Pa/100}hPa, RH={payload.humidity_RH}%, BAT={payload.battery_voltage}mV')
+    # Insert the per-phase rows of an energy report.
+    def record_energy(self, report_id, energy):
+        self.conn.executemany(self.SQL_INSERT_ENERGY,
+                              [(report_id, phase, energy.time_s[phase], energy.charge_uAh[phase])
+                               for phase in ENERGY_PHASES])
 
-        report_id = self.record_report(rec, payload.battery_voltage)
-
-        self.record_measurement(report_id, payload)
+    # Insert all rows of a decoded uplink. The caller commits.
+    def store(self, uplink):
+        rec = uplink.rec
+        if uplink.energy is not None:
+            report_id = self.record_report(rec, None, None, uplink.epoch_timestamp_ms)
+            self.record_energy(report_id, uplink.energy)
+        else:
+            # Battery voltage is kept per report, so use the latest sample.
+            battery_voltage = uplink.samples[-1].battery_voltage
+            report_id = self.record_report(rec, battery_voltage,
+                                           uplink.power_profile, uplink.epoch_timestamp_ms)
+            timed_samples = []
+            for sample in uplink.samples:
+                measured_at_ms = sample.measured_at_ms(uplink.epoch_timestamp_ms)
+                self.record_measurement(report_id, sample, measured_at_ms)
+                if measured_at_ms is not None:
+                    timed_samples.append((measured_at_ms, sample))
+            name_id = self.get_id_from_string('device_names', rec['deviceInfo']['deviceName'])
+            self.record_rollups(name_id, timed_samples, battery_voltage)
         for hotspot in rec['rxInfo']:
             self.record_hotspot(report_id, hotspot, float(rec['txInfo']['frequency']))
 
+    # Parse the given JSON string and queue it for insertion. Decoding
+    # errors are raised right away. The data is written by flush(), which
+    # is called here once the batch is full, and otherwise by poll().
+    def record(self, json_str):
+        uplink = Uplink(json_str, self.keys)
+        uplink.print()
+        self.queue(uplink)
+
+    # Queue a decoded uplink. Returns the uplinks written, if
+    # this filled the batch.
+    def queue(self, uplink):
+        if not self.pending:
+            self.pending_since = time.monotonic()
+        self.pending.append(uplink)
+        if len(self.pending) >= INGEST_BATCH_SIZE:
+            return self.flush()
+        return []
+
+    # Seconds until the pending batch is due, or None if there is none.
+    def flush_timeout(self):
+        if not self.pending:
+            return None
+        return max(self.pending_since + INGEST_BATCH_DELAY_S - time.monotonic(), 0)
+
+    # Write the pending batch if it has waited for long enough.
+    def poll(self):
+        if self.pending and self.flush_timeout() == 0:
+            return self.flush()
+        return []
+
+    # Write all pending uplinks in a single transaction.
+    # Returns the uplinks which were written.
+    def flush(self):
+        batch = self.pending
+        self.pending = []
+        if not batch:
+            return []
+        try:
+            with self.conn:
+                for uplink in batch:
+                    self.store(uplink)
+            return batch
+        except Exception as e:
+            # Retry one by one, so that a single bad
+            # uplink does not lose the whole batch.
+            # Names added by the rolled back transaction
+            # are gone, so forget their ids too.
+            print(f'Batch of {len(batch)} failed: {e}')
+            self.warm_name_caches()
+            written = []
+            for uplink in batch:
+                try:
+                    with self.conn:
+                        self.store(uplink)
+                    written.append(uplink)
+                except Exception as e:
+                    print(f'Dropping uplink {uplink.rec.get("fCnt")}: {e}')
+                    self.warm_name_caches()
+            return written
+
+    # Bulk replay of LNS records, one JSON document per line, e.g. to
+    # re-ingest an export after a schema change. Compact payloads and
+    # legacy records are decoded all at once with NumPy, and the rows
+    # are inserted with executemany(), one transaction per chunk. Report
+    # ids are assigned here, so do not run this while the server is
+    # writing. The garbage collector is off meanwhile: a chunk makes no
+    # reference cycles, but its millions of objects would have it scan
+    # the chunk over and over.
+    def replay(self, lines):
+        self.flush()
+        lines = (line for line in lines if line.strip())
+        count = 0
+        gc_enabled = gc.isenabled()
+        gc.disable()
+        try:
+            while True:
+                chunk = list(itertools.islice(lines, REPLAY_CHUNK_SIZE))
+                if not chunk:
+                    return count
+                count += self.replay_chunk(chunk)
+        finally:
+            if gc_enabled:
+                gc.enable()
+
+    def replay_chunk(self, lines):
+        import numpy
+
+        try:
+            recs = json.loads('[' + ','.join(lines) + ']')
+        except ValueError:
+            recs = []
+            for line in lines:
+                try:
+                    recs.append(json.loads(line))
+                except ValueError as e:
+                    print(f'Skipping invalid JSON: {e}')
+
+        # Decode the energy reports, and decrypt the data payloads.
+        uplinks = []
+        payload_bins = []
+        for rec in recs:
+            try:
+                timestamp_ms = int(datetime.datetime.fromisoformat(rec['time']).timestamp() * 1000)
+                if int(rec['fPort']) == DIAG_PORT:
+                    energy = EnergyReport()
+                    energy.decode(rec['data'])
+                    uplinks.append((rec, timestamp_ms, energy, [], None, 0))
+                    continue
+                payload_bin = base64.b64decode(rec['data'])
+                cipher = self.keys.get(rec['deviceInfo']['devEui']) if self.keys is not None else None
+                payload_bins.append((len(uplinks), payload_bin,
+                                     cipher.decrypt(payload_bin) if cipher is not None else payload_bin))
+            except Exception as e:
+                print(f'Skipping uplink {rec.get("fCnt")}: {e}')
+                continue
+            uplinks.append((rec, timestamp_ms, None, None, None, 0))
+
+        # Decode the compact payloads all at once. Those which do not
+        # parse as such, e.g. legacy ones, are decoded one by one.
+        decoded = decode_compact_batch([plain_bin for _, _, plain_bin in payload_bins],
+                                       [uplinks[u][1] for u, _, _ in payload_bins])
+        legacy = []
+        for (u, payload_bin, _), result in zip(payload_bins, decoded):
+            rec, timestamp_ms = uplinks[u][:2]
+            if result is not None:
+                power_profile, times, rows = result
+                uplinks[u] = (rec, timestamp_ms, None, list(zip(times, rows)), power_profile, 0)
+                continue
+            try:
+                payload = Payload()
+                samples, legacy_bin = payload.decode_compact(payload_bin, self.keys, rec['deviceInfo']['devEui'])
+                if legacy_bin is not None and (len(legacy_bin) == 0 or len(legacy_bin) % LEGACY_RECORD.size):
+                    raise ValueError(f'Invalid payload length {len(legacy_bin)}')
+            except Exception as e:
+                print(f'Skipping uplink {rec.get("fCnt")}: {e}')
+                uplinks[u] = None
+                continue
+            if legacy_bin is not None:
+                legacy.append(legacy_bin)
+                uplinks[u] = (rec, timestamp_ms, None, None, payload.power_profile,
+                              len(legacy_bin) // LEGACY_RECORD.size)
+            else:
+                timed_vals = [(sample.measured_at_ms(timestamp_ms),
+                               [sample.temperature, sample.pressure_Pa, sample.humidity_RH, sample.battery_voltage])
+                              for sample in samples]
+                uplinks[u] = (rec, timestamp_ms, None, timed_vals, payload.power_profile, 0)
+        uplinks = [uplink for uplink in uplinks if uplink is not None]
+
+        # All legacy records of the chunk in one array.
+        legacy_dtype = numpy.dtype([('temperature', '<i4'), ('pressure', '<i4'),
+                                    ('humidity', 'i1'), ('battery', '<i2')])
+        records = numpy.frombuffer(b''.join(legacy), dtype=legacy_dtype)
+        legacy_vals = numpy.column_stack((records['temperature'] / 1000.0 - 273.15,
+                                          records['pressure'].astype(float),
+                                          records['humidity'].astype(float),
+                                          records['battery'] / 1000.0)).tolist()
+        legacy_pos = 0
+
+        with self.conn:
+            report_id = self.conn.execute('SELECT COALESCE(MAX(id), 0) FROM reports').fetchone()[0]
+            reports = []
+            measurements = []
+            hotspots = []
+            energies = []
+            rollups = []
+            for rec, timestamp_ms, energy, timed_vals, power_profile, legacy_count in uplinks:
+                if timed_vals is None:
+                    timed_vals = [(timestamp_ms, vals) for vals in legacy_vals[legacy_pos:legacy_pos + legacy_count]]
+                    legacy_pos += legacy_count
+                # Collect the rows of each uplink first, so that a
+                # malformed record adds none of them.
+                try:
+                    name_id = self.get_id_from_string('device_names', rec['deviceInfo']['deviceName'])
+                    battery_voltage = None
+                    if timed_vals:
+                        # Battery voltage is kept per report, so use the latest sample.
+                        battery_voltage = timed_vals[-1][1][3]
+                    report = (self.get_id_from_string('dev_eui', rec['deviceInfo']['devEui']),
+                              self.get_id_from_string('dev_addr', rec['devAddr']),
+                              int(rec['dc']['balance'] if 'dc' in rec else -1),
+                              int(rec['fCnt']),
+                              int(rec['fPort']),
+                              name_id,
+                              self.get_id_from_string('profile_names', rec['deviceInfo']['deviceProfileName']),
+                              battery_voltage,
+                              power_profile,
+                              timestamp_ms)
+                    rec_hotspots = [(int(float(rec['txInfo']['frequency'])),
+                                     self.get_hotspot_id(hotspot['metadata']['gateway_name'],
+                                                         float(hotspot['metadata']['gateway_lat']),
+                                                         float(hotspot['metadata']['gateway_long'])),
+                                     float(hotspot['rssi']),
+                                     float(hotspot['snr'] if 'snr' in hotspot else -1000000))
+                                    for hotspot in rec['rxInfo']]
+                except Exception as e:
+                    print(f'Skipping uplink {rec.get("fCnt")}: {e}')
+                    continue
+
+                report_id += 1
+                reports.append((report_id,) + report)
+                hotspots += [(report_id,) + hotspot for hotspot in rec_hotspots]
+                if energy is not None:
+                    energies += [(report_id, phase, energy.time_s[phase], energy.charge_uAh[phase])
+                                 for phase in ENERGY_PHASES]
+                for measured_at_ms, vals in timed_vals:
+                    measurements.append((report_id, vals[0], vals[1], vals[2], measured_at_ms))
+                    if measured_at_ms is not None:
+                        rollups.append((name_id, measured_at_ms, vals[:3] + [battery_voltage]))
+
+            self.conn.executemany('INSERT INTO reports (id, dev_eui_id, dev_addr_id, dc_balance, fcnt, port, name_id, profile_id, battery_voltage, power_profile, reported_at_ms) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)', reports)
+            self.conn.executemany(self.SQL_INSERT_MEASUREMENT, measurements)
+            self.conn.executemany(self.SQL_INSERT_HOTSPOT, hotspots)
+            self.conn.executemany(self.SQL_INSERT_ENERGY, energies)
+            if rollups:
+                # Add up the samples per device and period first.
+                name_ids = numpy.array([r[0] for r in rollups])
+                times = numpy.array([r[1] for r in rollups], dtype=numpy.int64)
+                vals = numpy.array([r[2] for r in rollups], dtype=float)
+                for table, period_ms in ROLLUP_PERIODS:
+                    buckets = times // period_ms * period_ms
+                    order = numpy.lexsort((buckets, name_ids))
+                    ids, buckets, sorted_vals = name_ids[order], buckets[order], vals[order]
+                    starts = numpy.flatnonzero(numpy.r_[True, (ids[1:] != ids[:-1]) | (buckets[1:] != buckets[:-1])])
+                    counts = numpy.diff(numpy.r_[starts, len(ids)])
+                    aggs = []
+                    for f in range(len(ROLLUP_FIELDS)):
+                        aggs += [numpy.minimum.reduceat(sorted_vals[:, f], starts).tolist(),
+                                 numpy.maximum.reduceat(sorted_vals[:, f], starts).tolist(),
+                                 numpy.add.reduceat(sorted_vals[:, f], starts).tolist()]
+                    self.conn.executemany(self.SQL_UPSERT_ROLLUP[table],
+                                          zip(ids[starts].tolist(), buckets[starts].tolist(),
+                                              counts.tolist(), *aggs))
+
+        return len(reports)
+
 if __name__ == '__main__':
     t = Meteo()
     # If invoked from the command line, then
     # parse JSON lines from stdin. Useful
-    # for quick integration testing.
+    # for quick integration testing, or with
+    # --replay, for bulk loading LNS exports.
+    if len(sys.argv) == 2 and sys.argv[1] == '--replay':
+        print(f'Replayed {t.replay(sys.stdin)} uplinks')
+        exit(0)
     for line in sys.stdin:
         t.record(line)
+    t.flush()
@@ -8,23 +8,56 @@ import sqlite3
 import pandas
 import matplotlib.pyplot as plt
 import matplotlib.dates as pltdates
+import archive
  
 
-def plot(name):
+# Use the coarsest rollup which still gives at least this many points.
+PLOT_MIN_POINTS = 200
+HOUR_MS = 3600 * 1000
+DAY_MS = 24 * HOUR_MS
+
+RANGE_SQL = "COALESCE(strftime('%s', :start, 'utc') * 1000, 0) AND COALESCE(strftime('%s', :end, 'utc') * 1000, 9223372036854775807)"
+DEVICE_SQL = "(SELECT id FROM device_names WHERE device_names.name = :name)"
+
+def rollup_sql(table):
+    return f"""
+SELECT datetime(bucket_ms / 1000, 'unixepoch', 'localtime') as t, temperature_sum / count as temperature, pressure_sum / count / 1000 as pressure, humidity_sum / count as humidity
+FROM {table}
+WHERE name_id = {DEVICE_SQL}
+AND bucket_ms BETWEEN {RANGE_SQL}
+ORDER BY bucket_ms;
+"""
+
+# Start and end are local times, e.g. '2024-01-01' or '2024-01-01 12:00'.
+# None leaves that end of the time range open.
+def plot(name, start=None, end=None):
     conn = sqlite3.connect("meteo.db")
- 
-    sql = """
-SELECT datetime(reports.reported_at_ms / 1000, 'unixepoch', 'localtime') as t, measurements.temperature as temperature, measurements.pressure / 1000 as pressure, measurements.humidity as humidity
-FROM (((((reports
-INNER JOIN dev_eui ON dev_eui.id = reports.dev_eui_id)
-INNER JOIN dev_addr ON dev_addr.id = reports.dev_addr_id)
-INNER JOIN device_names ON device_names.id = reports.name_id)
-INNER JOIN measurements ON measurements.report_id = reports.id)
-INNER JOIN hotspot_connections ON hotspot_connections.report_id = reports.id)
-WHERE device_names.id = (SELECT id FROM device_names WHERE device_names.name = ? )
-GROUP BY reports.id;
+    params = {'name': name, 'start': start, 'end': end}
+
+    # Time span to draw, limited to the data there is.
+    span_ms = conn.execute(f"""
+SELECT MIN(COALESCE(strftime('%s', :end, 'utc') * 1000, MAX(bucket_ms) + {DAY_MS}), MAX(bucket_ms) + {DAY_MS}) - MAX(COALESCE(strftime('%s', :start, 'utc') * 1000, 0), MIN(bucket_ms))
+FROM rollup_daily
+WHERE name_id = {DEVICE_SQL}
+""", params).fetchone()[0] or 0
+
+    if span_ms >= PLOT_MIN_POINTS * DAY_MS:
+        sql = rollup_sql('rollup_daily')
+    elif span_ms >= PLOT_MIN_POINTS * HOUR_MS:
+        sql = rollup_sql('rollup_hourly')
+    else:
+        # Raw data may have been moved to the archive. Untimed
+        # samples, logged before a reboot, are drawn at the time of
+        # the uplink which carried them.
+        archive.attach(conn, name, start, end)
+        sql = f"""
+SELECT datetime(COALESCE(measured_at_ms, reported_at_ms) / 1000, 'unixepoch', 'localtime') as t, temperature, pressure / 1000 as pressure, humidity
+FROM all_measurements
+WHERE COALESCE(measured_at_ms, reported_at_ms) BETWEEN {RANGE_SQL}
+AND name_id = {DEVICE_SQL}
+ORDER BY COALESCE(measured_at_ms, reported_at_ms);
 """
-    data = pandas.read_sql(sql=sql, con=conn, params=(name, ))
+    data = pandas.read_sql(sql=sql, con=conn, params=params)
  
     t = pltdates.date2num(data.t)
 
@@ -39,8 +72,8 @@ GROUP BY reports.id;
 if __name__ == '__main__':
     from sys import argv
 
-    if len(argv) != 2:
-        print("Usage: ./plot.py name")
+    if len(argv) < 2 or len(argv) > 4:
+        print("Usage: ./plot.py name [start [end]]")
         exit(1)
     else:
-        plot(argv[1])
+        plot(*argv[1:])
@@ -1,8 +1,14 @@
-SELECT datetime(reports.reported_at_ms / 1000, 'unixepoch', 'localtime'), reports.dc_balance, COUNT(hotspot_connections.id), reports.fcnt, device_names.name, reports.battery_voltage, measurements.temperature, measurements.pressure, measurements.humidity
-FROM (((((reports
-INNER JOIN dev_eui ON dev_eui.id = reports.dev_eui_id)
-INNER JOIN dev_addr ON dev_addr.id = reports.dev_addr_id)
+-- Optionally filter by device name and by local time, e.g.:
+--   sqlite3 meteo.db -cmd ".parameter set :device \"'meteo1'\"" \
+--       -cmd ".parameter set :start \"'2024-01-01'\"" \
+--       -cmd ".parameter set :end \"'2024-01-08'\"" < queries/dump-data.sql
+-- Untimed samples, logged before a reboot, have no time. They are left
+-- out when filtering by time.
+SELECT datetime(measurements.measured_at_ms / 1000, 'unixepoch', 'localtime'), reports.dc_balance, (SELECT COUNT(*) FROM hotspot_connections WHERE hotspot_connections.report_id = reports.id), reports.fcnt, device_names.name, reports.battery_voltage, measurements.temperature, measurements.pressure, measurements.humidity
+FROM ((measurements
+INNER JOIN reports ON reports.id = measurements.report_id)
 INNER JOIN device_names ON device_names.id = reports.name_id)
-INNER JOIN measurements ON measurements.report_id = reports.id)
-INNER JOIN hotspot_connections ON hotspot_connections.report_id = reports.id)
-GROUP BY reports.id;
+WHERE ((measurements.measured_at_ms IS NULL AND :start IS NULL AND :end IS NULL)
+       OR measurements.measured_at_ms BETWEEN COALESCE(strftime('%s', :start, 'utc') * 1000, 0) AND COALESCE(strftime('%s', :end, 'utc') * 1000, 9223372036854775807))
+AND (:device IS NULL OR device_names.name = :device)
+ORDER BY measurements.measured_at_ms;
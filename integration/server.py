@@ -6,16 +6,100 @@
 # from a Helium meteo sensor.
 # Usage::
 #    ./server.py [<port>]
+#
+# Requests are served by one thread each. Uplinks are decoded right
+# away, and then handed over a bounded queue to a single writer thread,
+# which owns the database connection. GET /status returns the queue
+# depth and ingest latency as JSON. Queued configuration commands
+# are sent to devices as their uplinks come in, see downlink.py.
 
-from http.server import BaseHTTPRequestHandler, HTTPServer
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+import collections
+import json
 import logging
+import queue
+import threading
+import time
 import meteo
+import downlink
 
-class Server(BaseHTTPRequestHandler):
-    def __init__(self, *args):
-        self.meteo = meteo.Meteo()
-        BaseHTTPRequestHandler.__init__(self, *args)
+# Uplinks waiting for the writer. When full, POSTs are answered
+# with 503, so that the LNS retries them later.
+INGEST_QUEUE_SIZE = 10000
+# Number of recent uplinks the latency percentiles are taken from.
+LATENCY_WINDOW = 1000
+
+# Ingest counters and latency, shared by the request threads and the writer.
+class IngestStats():
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.received = 0
+        self.rejected = 0
+        self.written = 0
+        self.max_queue_depth = 0
+        self.latencies_s = collections.deque(maxlen=LATENCY_WINDOW)
+
+    def receive(self, queue_depth):
+        with self.lock:
+            self.received += 1
+            self.max_queue_depth = max(self.max_queue_depth, queue_depth)
+
+    def reject(self):
+        with self.lock:
+            self.rejected += 1
+
+    def write(self, uplinks):
+        now = time.monotonic()
+        with self.lock:
+            self.written += len(uplinks)
+            for uplink in uplinks:
+                self.latencies_s.append(now - uplink.received_at)
+
+    def percentile_ms(self, latencies, p):
+        if not latencies:
+            return None
+        return round(latencies[min(int(len(latencies) * p), len(latencies) - 1)] * 1000, 1)
+
+    def report(self, queue_depth):
+        with self.lock:
+            latencies = sorted(self.latencies_s)
+            return {
+                'queue_depth': queue_depth,
+                'queue_size': INGEST_QUEUE_SIZE,
+                'max_queue_depth': self.max_queue_depth,
+                'received': self.received,
+                'rejected': self.rejected,
+                'written': self.written,
+                'latency_ms': {
+                    'p50': self.percentile_ms(latencies, 0.50),
+                    'p99': self.percentile_ms(latencies, 0.99),
+                },
+            }
+
+# Drains the queue into the database. SQLite connections may only be
+# used by the thread which created them, so the writer creates its own.
+class Writer(threading.Thread):
+    def __init__(self, uplinks, stats):
+        threading.Thread.__init__(self, name='writer')
+        self.uplinks = uplinks
+        self.stats = stats
 
+    def run(self):
+        m = meteo.Meteo()
+        while True:
+            try:
+                uplink = self.uplinks.get(timeout=m.flush_timeout())
+            except queue.Empty:
+                self.stats.write(m.poll())
+                continue
+            # None asks the writer to stop.
+            if uplink is None:
+                break
+            self.stats.write(m.queue(uplink))
+            self.stats.write(m.poll())
+        self.stats.write(m.flush())
+
+class Server(BaseHTTPRequestHandler):
     def _set_response(self):
         self.send_response(200)
         self.send_header('Content-type', 'text/html')
@@ -23,17 +107,23 @@ class Server(BaseHTTPRequestHandler):
 
     def do_GET(self):
         logging.debug("GET request,\nPath: %s\nHeaders:\n%s\n", str(self.path), str(self.headers))
+        if self.path == '/status':
+            status = self.server.stats.report(self.server.uplinks.qsize())
+            status['downlinks_sent'] = self.server.downlinks.sent
+            self.send_response(200)
+            self.send_header('Content-type', 'application/json')
+            self.end_headers()
+            self.wfile.write(json.dumps(status).encode('utf-8'))
+            return
         self._set_response()
         self.wfile.write("42".encode('utf-8'))
 
     def do_POST(self):
-        self.send_response(200)
-        self.end_headers()
-
         content_length = int(self.headers['Content-Length']) # <--- Gets the size of data
         post_data = self.rfile.read(content_length) # <--- Gets the data itself
         logging.debug("POST request,\nPath: %s\nHeaders:\n%s\n\nBody:\n%s\n",
                 str(self.path), str(self.headers), post_data.decode('utf-8'))
+        status = 200
         try:
             event = 'unknown'
             for arg in self.path.split('?'):
@@ -45,15 +135,46 @@ class Server(BaseHTTPRequestHandler):
                     event = path_val
                     break
             if event == 'up':
-                self.meteo.record(post_data)
+                uplink = meteo.Uplink(post_data, self.server.keys)
+                uplink.print()
+                self.server.downlinks.uplink(uplink.rec['deviceInfo']['devEui'])
+                try:
+                    self.server.uplinks.put_nowait(uplink)
+                    self.server.stats.receive(self.server.uplinks.qsize())
+                except queue.Full:
+                    self.server.stats.reject()
+                    status = 503
             else:
                 print('Ignoring event ' + event)
         except Exception as e:
             print('Exception occurred with the following json: {}'.format(post_data))
             print('Exception: ' + str(e))
+        self.send_response(status)
+        self.end_headers()
         logging.info('Received: json: {}'.format(post_data))
 
-def run(server_class=HTTPServer, handler_class=Server, port=8085):
+class MeteoHTTPServer(ThreadingHTTPServer):
+    # Listen backlog, for the bursts of retries after an outage.
+    request_queue_size = 128
+
+    def __init__(self, *args):
+        ThreadingHTTPServer.__init__(self, *args)
+        self.uplinks = queue.Queue(maxsize=INGEST_QUEUE_SIZE)
+        self.keys = meteo.PayloadKeys()
+        self.stats = IngestStats()
+        self.writer = Writer(self.uplinks, self.stats)
+        self.writer.start()
+        self.downlinks = downlink.DownlinkSender()
+        self.downlinks.start()
+
+    def server_close(self):
+        ThreadingHTTPServer.server_close(self)
+        # Write out whatever is still queued.
+        self.uplinks.put(None)
+        self.writer.join()
+        self.downlinks.stop()
+
+def run(server_class=MeteoHTTPServer, handler_class=Server, port=8085):
     logging.basicConfig(level=logging.INFO)
     server_address = ('', port)
     httpd = server_class(server_address, handler_class)
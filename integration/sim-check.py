@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Check the sample times in the uplink log of a native_sim run, see the
+# Simulation section of the firmware README. Each sample must decode to
+# a time between the start of its run and the uplink which carried it,
+# whether it was sent with its age or with its GPS time.
+# Usage::
+#    ./sim-check.py [uplinks.csv]
+
+import csv
+import sys
+import datetime
+import meteo
+
+# Network clock of the loopback LoRaWAN, see
+# app/src/sim/lorawan_loopback.c. Keep in sync.
+LOOPBACK_GPS_TIME_BASE_S = 1451260818
+LOOPBACK_CLOCK_DRIFT_PPM = 20
+# Sample times have a 1 s resolution, and ages round down.
+SLACK_S = 2
+
+# Unix time of the network at the given uptime of a run.
+def network_time_s(uptime_ms):
+    return (LOOPBACK_GPS_TIME_BASE_S + meteo.GPS_UNIX_OFFSET_S +
+            uptime_ms * (1 + LOOPBACK_CLOCK_DRIFT_PPM / 1e6) / 1000)
+
+def check(path):
+    uplinks = samples = untimed = errors = 0
+    run_uptime_ms = -1
+    with open(path, newline='') as f:
+        reader = csv.DictReader(f)
+        for row in reader:
+            uptime_ms = int(row['uptime_ms'])
+            if uptime_ms < run_uptime_ms:
+                # The log is appended to by each run.
+                print(f'New run at line {reader.line_num}')
+            run_uptime_ms = uptime_ms
+            if int(row['port']) in (0, meteo.DIAG_PORT) or not row['payload']:
+                continue
+            decoded = meteo.Payload().decode_varint(bytes.fromhex(row['payload']))
+            uplinks += 1
+            sent_s = network_time_s(uptime_ms)
+            for sample in decoded:
+                samples += 1
+                if sample.time_s is not None:
+                    time_s = sample.time_s
+                elif sample.age_s is not None:
+                    time_s = sent_s - sample.age_s
+                else:
+                    untimed += 1
+                    continue
+                if not network_time_s(0) - SLACK_S <= time_s <= sent_s + SLACK_S:
+                    errors += 1
+                    print(f'fcnt {row["fcnt"]}: sample at '
+                          f'{datetime.datetime.fromtimestamp(time_s, datetime.timezone.utc)}, '
+                          f'sent at {datetime.datetime.fromtimestamp(sent_s, datetime.timezone.utc)}')
+    print(f'{uplinks} uplinks, {samples} samples, {untimed} untimed, {errors} out of range')
+    return errors == 0
+
+if __name__ == '__main__':
+    if len(sys.argv) > 2:
+        print("Usage: ./sim-check.py [uplinks.csv]")
+        exit(1)
+    exit(0 if check(sys.argv[1] if len(sys.argv) == 2 else 'uplinks.csv') else 1)